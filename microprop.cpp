@@ -1,14 +1,36 @@
 #include "microprop.h"
 
+#include <cmath>
+#include <limits>
+
 using namespace microprop;
 
 Encoder::Encoder() : Encoder(nullptr, 0) {
 }
 
-Encoder::Encoder(uint8_t *data, size_t size) {
+Encoder::Encoder(uint8_t *data, size_t size) : m_compact_float(false) {
     AssignBuffer(data, size);
 }
 
+Encoder::Encoder(const Encoder & other) : Encoder(other.m_data, other.m_size) {
+    m_used = other.m_used;
+    m_compact_float = other.m_compact_float;
+    m_group_depth = other.m_group_depth;
+    std::copy(other.m_group, other.m_group + m_group_depth, m_group);
+}
+
+Encoder & Encoder::operator=(const Encoder & other) {
+    if(this != &other) {
+        // The packer refers to this object, so it is initialized again
+        AssignBuffer(other.m_data, other.m_size);
+        m_used = other.m_used;
+        m_compact_float = other.m_compact_float;
+        m_group_depth = other.m_group_depth;
+        std::copy(other.m_group, other.m_group + m_group_depth, m_group);
+    }
+    return *this;
+}
+
 Encoder::~Encoder() {
 }
 
@@ -16,6 +38,7 @@ bool Encoder::AssignBuffer(uint8_t *data, size_t size) {
     m_data = data;
     m_size = size;
     m_used = 0;
+    m_group_depth = 0;
     msgpack_packer_init(&m_pk, data, &msgpack_callback, this);
     return data && size;
 }
@@ -39,140 +62,2211 @@ bool Encoder::WriteAsString(KeyType id, const char *str) {
     return false;
 }
 
-int Encoder::callback_func(void* data, const char* buf, size_t len) {
-    assert(m_data == data);
-    if(m_used + len <= m_size) {
-        if(buf && len) {
-            memcpy(&m_data[m_used], buf, len);
-            m_used += len;
-        } else {
-            assert(buf == nullptr && len == 0);
-        }
-        return 0;
+/*
+ * Group header is bin 32 with the size filled in by EndGroup
+ */
+static const uint8_t group_header[] = {0xC6, 0, 0, 0, 0};
+
+bool Encoder::BeginGroup(KeyType id) {
+    if(m_group_depth >= MICROPROP_GROUP_DEPTH) {
+        return false;
     }
-    return -1;
+    size_t temp = m_used;
+    if(id && msgpack_write(id) && callback_func(m_data, reinterpret_cast<const char *> (group_header), sizeof (group_header)) == 0) {
+        m_group[m_group_depth++] = m_used - sizeof (group_header);
+        return true;
+    }
+    m_used = temp;
+    return false;
 }
 
-int Encoder::msgpack_callback(void* data, const char* buf, size_t len, void* callback_param) {
-    Encoder * obj = static_cast<Encoder *> (callback_param);
-    if(obj) {
-        return obj->callback_func(data, buf, len);
+bool Encoder::EndGroup() {
+    if(!m_group_depth) {
+        return false;
     }
-    return -1;
+    size_t start = m_group[--m_group_depth];
+    if(m_used < start + sizeof (group_header)) {
+        return false;
+    }
+    uint64_t size = m_used - start - sizeof (group_header);
+    if(size > 0xFFFFFFFF) {
+        return false;
+    }
+    for (size_t i = 1; i < sizeof (group_header); i++) {
+        m_data[start + i] = static_cast<uint8_t> (size >> (8 * (sizeof (group_header) - 1 - i)));
+    }
+    return true;
+}
+
+bool Encoder::WriteRaw(KeyType id, const uint8_t *data, size_t size) {
+    size_t temp = m_used;
+    if(id && data && size && msgpack_write(id) && callback_func(m_data, reinterpret_cast<const char *> (data), size) == 0) {
+        return true;
+    }
+    m_used = temp;
+    return false;
 }
 
 /*
- * 
+ * Removed fields are stored in the patch with a nil value, which is not used for regular fields.
  */
-Decoder::Decoder() : Decoder(static_cast<uint8_t *> (nullptr), 0) {
-}
+static const uint8_t patch_removed[] = {0xC0};
 
-Decoder::Decoder(uint8_t *data, size_t size) {
-    AssignBuffer(data, size);
+static inline bool is_patch_removed(const uint8_t *data, size_t size) {
+    return size == sizeof (patch_removed) && data[0] == patch_removed[0];
 }
 
-Decoder::Decoder(const uint8_t *data, size_t size) {
-    AssignBuffer(const_cast<uint8_t *> (data), size);
-}
+bool Encoder::WriteDiff(Decoder & base, Decoder & current) {
+    size_t temp = m_used;
+    KeyType id;
+    const uint8_t *base_value;
+    const uint8_t *current_value;
+    size_t base_size;
+    size_t current_size;
 
-Decoder::~Decoder() {
-}
+    // Changed and removed fields
+    base.Reset();
+    current.Reset();
+    while(base.FieldNext(id)) {
+        if(!base.FieldValue(base_value, base_size)) {
+            m_used = temp;
+            return false;
+        }
+        if(current.FieldSeek(id)) {
+            if(!current.FieldValue(current_value, current_size)) {
+                m_used = temp;
+                return false;
+            }
+            if(base_size == current_size && memcmp(base_value, current_value, base_size) == 0) {
+                continue;
+            }
+            if(!WriteRaw(id, current_value, current_size)) {
+                m_used = temp;
+                return false;
+            }
+        } else if(!WriteRaw(id, patch_removed, sizeof (patch_removed))) {
+            m_used = temp;
+            return false;
+        }
+    }
+    // A decode error is not the end of the record
+    if(!base.FieldEnd()) {
+        m_used = temp;
+        return false;
+    }
 
-bool Decoder::AssignBuffer(uint8_t *data, size_t size) {
-    const_cast<char*&> (m_data) = reinterpret_cast<char *> (data);
-    m_size = size;
-    m_offset = 0;
-    return data && size;
+    // Added fields
+    base.Reset();
+    current.Reset();
+    while(current.FieldNext(id)) {
+        if(base.FieldSeek(id)) {
+            continue;
+        }
+        if(!current.FieldValue(current_value, current_size) || !WriteRaw(id, current_value, current_size)) {
+            m_used = temp;
+            return false;
+        }
+    }
+    if(!current.FieldEnd()) {
+        m_used = temp;
+        return false;
+    }
+    return true;
 }
 
-bool Decoder::FieldFind(KeyType id) {
-    if(!m_data || !m_size || !check_key_type(m_data[0])) {
+bool Encoder::WritePatch(Decoder & base, Decoder & patch) {
+    size_t temp = m_used;
+    KeyType id;
+    KeyType patch_id;
+    const uint8_t *value;
+    size_t size;
+
+    base.Reset();
+    patch.Reset();
+
+    // The patch stores the fields of the base record in the same order, followed by the added fields
+    bool pending = patch.FieldNext(patch_id);
+    while(base.FieldNext(id)) {
+        if(pending && patch_id == id) {
+            if(!patch.FieldValue(value, size)) {
+                m_used = temp;
+                return false;
+            }
+            pending = patch.FieldNext(patch_id);
+            if(is_patch_removed(value, size)) {
+                continue;
+            }
+        } else if(!base.FieldValue(value, size)) {
+            m_used = temp;
+            return false;
+        }
+        if(!WriteRaw(id, value, size)) {
+            m_used = temp;
+            return false;
+        }
+    }
+    if(!base.FieldEnd()) {
+        m_used = temp;
         return false;
     }
-    m_offset = 0;
-    KeyType field_id;
-    while(FieldNext(field_id)) {
-        if(field_id == id) {
+    while(pending) {
+        if(!patch.FieldValue(value, size)) {
+            m_used = temp;
+            return false;
+        }
+        if(!is_patch_removed(value, size) && !WriteRaw(patch_id, value, size)) {
+            m_used = temp;
+            return false;
+        }
+        pending = patch.FieldNext(patch_id);
+    }
+    if(!patch.FieldEnd()) {
+        m_used = temp;
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Open addressing hash set of keys in the caller buffer, zero key marks an empty slot.
+ * Returns false if the set is full.
+ */
+static bool seen_insert(KeyType id, KeyType *seen, size_t size, bool & found) {
+    size_t pos = static_cast<size_t> (id * 2654435761U) % size;
+    for (size_t i = 0; i < size; i++) {
+        if(seen[pos] == id) {
+            found = true;
+            return true;
+        } else if(seen[pos] == 0) {
+            seen[pos] = id;
+            found = false;
             return true;
         }
+        pos = (pos + 1) % size;
     }
     return false;
 }
 
-bool Decoder::FieldNext(KeyType & id) {
-    if(!m_data || !m_size || m_offset >= m_size) {
+bool Encoder::Merge(Decoder * layers[], size_t count, KeyType *seen, size_t seen_size) {
+    if(!layers || !seen || !seen_size) {
         return false;
     }
-    if(m_offset != 0) {
-        // Skip field data
-
-        msgpack_unpacked msg;
-        msgpack_unpacked_init(&msg);
+    size_t temp = m_used;
+    KeyType id;
+    const uint8_t *value;
+    size_t size;
+    bool found;
 
-        if(msgpack_unpack_next(&msg, m_data, m_size, &m_offset) < 0) {
+    memset(seen, 0, sizeof (KeyType) * seen_size);
+    for (size_t i = count; i-- > 0;) {
+        Decoder & layer = *layers[i];
+        layer.Reset();
+        while(layer.FieldNext(id)) {
+            if(!seen_insert(id, seen, seen_size, found)) {
+                m_used = temp;
+                return false;
+            }
+            if(found) {
+                continue;
+            }
+            if(!layer.FieldValue(value, size) || !WriteRaw(id, value, size)) {
+                m_used = temp;
+                return false;
+            }
+        }
+        if(!layer.FieldEnd()) {
+            m_used = temp;
             return false;
         }
+    }
+    return true;
+}
 
-        assert(msg.zone == nullptr);
+/*
+ * JSON parsing helpers
+ */
+static inline void json_space(const char * & p, const char *end) {
+    while(p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+        p++;
+    }
+}
 
-        // if the field data is an array, skip all its elements
-        msgpack_object array = msg.data;
-        if(array.type == MSGPACK_OBJECT_ARRAY) {
-            size_t count = array.via.array.size;
-            for (size_t i = 0; i < count; i++) {
-                if(msgpack_unpack_next(&msg, m_data, m_size, &m_offset) < 0) {
-                    return false;
+static inline bool json_expect(const char * & p, const char *end, char value) {
+    json_space(p, end);
+    if(p < end && *p == value) {
+        p++;
+        return true;
+    }
+    return false;
+}
+
+template < size_t N>
+static inline bool json_literal(const char * & p, const char *end, const char (&literal)[N]) {
+    const size_t len = N - 1;
+    if(p < end && *p == literal[0] && static_cast<size_t> (end - p) >= len && memcmp(p, literal, len) == 0) {
+        p += len;
+        return true;
+    }
+    return false;
+}
+
+static inline int json_hex(char value) {
+    if(value >= '0' && value <= '9') {
+        return value - '0';
+    } else if(value >= 'a' && value <= 'f') {
+        return value - 'a' + 10;
+    } else if(value >= 'A' && value <= 'F') {
+        return value - 'A' + 10;
+    }
+    return -1;
+}
+
+static bool json_code(const char * & p, const char *end, uint32_t & code) {
+    if(end - p < 4) {
+        return false;
+    }
+    code = 0;
+    for (int i = 0; i < 4; i++) {
+        int digit = json_hex(*p++);
+        if(digit < 0) {
+            return false;
+        }
+        code = (code << 4) | static_cast<uint32_t> (digit);
+    }
+    return true;
+}
+
+/*
+ * Decode JSON string after the opening quote and pass the bytes to the output in runs.
+ * The same function counts the decoded size and writes it, so both passes agree.
+ */
+template < typename Output>
+static bool json_string(const char * & p, const char *end, Output output) {
+    while(p < end) {
+        char value = *p++;
+        if(value == '"') {
+            return true;
+        } else if(value == '\\') {
+            if(p >= end) {
+                return false;
+            }
+            char temp;
+            switch(*p++) {
+                case '"': temp = '"';
+                    break;
+                case '\\': temp = '\\';
+                    break;
+                case '/': temp = '/';
+                    break;
+                case 'b': temp = '\b';
+                    break;
+                case 'f': temp = '\f';
+                    break;
+                case 'n': temp = '\n';
+                    break;
+                case 'r': temp = '\r';
+                    break;
+                case 't': temp = '\t';
+                    break;
+                case 'u':
+                {
+                    uint32_t code;
+                    if(!json_code(p, end, code)) {
+                        return false;
+                    }
+                    if(code >= 0xD800 && code <= 0xDBFF) {
+                        // Surrogate pair
+                        uint32_t low;
+                        if(end - p < 2 || p[0] != '\\' || p[1] != 'u') {
+                            return false;
+                        }
+                        p += 2;
+                        if(!json_code(p, end, low) || low < 0xDC00 || low > 0xDFFF) {
+                            return false;
+                        }
+                        code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                    }
+                    char utf8[4];
+                    size_t len;
+                    if(code < 0x80) {
+                        utf8[0] = static_cast<char> (code);
+                        len = 1;
+                    } else if(code < 0x800) {
+                        utf8[0] = static_cast<char> (0xC0 | (code >> 6));
+                        utf8[1] = static_cast<char> (0x80 | (code & 0x3F));
+                        len = 2;
+                    } else if(code < 0x10000) {
+                        utf8[0] = static_cast<char> (0xE0 | (code >> 12));
+                        utf8[1] = static_cast<char> (0x80 | ((code >> 6) & 0x3F));
+                        utf8[2] = static_cast<char> (0x80 | (code & 0x3F));
+                        len = 3;
+                    } else {
+                        utf8[0] = static_cast<char> (0xF0 | (code >> 18));
+                        utf8[1] = static_cast<char> (0x80 | ((code >> 12) & 0x3F));
+                        utf8[2] = static_cast<char> (0x80 | ((code >> 6) & 0x3F));
+                        utf8[3] = static_cast<char> (0x80 | (code & 0x3F));
+                        len = 4;
+                    }
+                    if(!output(utf8, len)) {
+                        return false;
+                    }
+                    continue;
                 }
-                if(m_offset + (count - i) > m_size) {
+                default:
                     return false;
+            }
+            if(!output(&temp, 1)) {
+                return false;
+            }
+        } else if(static_cast<unsigned char> (value) < 0x20) {
+            return false;
+        } else {
+            // Run of plain chars
+            const char *start = p - 1;
+            while(p < end && *p != '"' && *p != '\\' && static_cast<unsigned char> (*p) >= 0x20) {
+                p++;
+            }
+            if(!output(start, static_cast<size_t> (p - start))) {
+                return false;
+            }
+        }
+    }
+    return false;
+}
+
+static const char base64_chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static inline int base64_value(char value) {
+    if(value >= 'A' && value <= 'Z') {
+        return value - 'A';
+    } else if(value >= 'a' && value <= 'z') {
+        return value - 'a' + 26;
+    } else if(value >= '0' && value <= '9') {
+        return value - '0' + 52;
+    } else if(value == '+') {
+        return 62;
+    } else if(value == '/') {
+        return 63;
+    }
+    return -1;
+}
+
+/*
+ * Skip a number or a literal in the first pass over an array
+ */
+static bool json_skip(const char * & p, const char *end) {
+    const char *start = p;
+    while(p < end && ((*p >= '0' && *p <= '9') || *p == '-' || *p == '+' || *p == '.' || *p == 'E' || (*p >= 'a' && *p <= 'z'))) {
+        p++;
+    }
+    return p != start;
+}
+
+static inline bool json_digit(const char *p, const char *end) {
+    return p < end && *p >= '0' && *p <= '9';
+}
+
+/*
+ * Parse JSON number -?(0|[1-9][0-9]*)(.[0-9]+)?([eE][+-]?[0-9]+)? without the locale.
+ * The value is mantissa * 10^exponent, digits after the first 19 ones are dropped.
+ * @param integer Receives true for integers without dropped digits
+ * @param exact Receives false if non-zero digits are dropped
+ */
+static bool json_number(const char * & p, const char *end, uint64_t & mantissa, int & exponent, bool & integer, bool & exact) {
+    mantissa = 0;
+    exponent = 0;
+    integer = true;
+    exact = true;
+    if(!json_digit(p, end)) {
+        return false;
+    }
+    if(*p == '0') {
+        p++;
+    } else {
+        while(json_digit(p, end)) {
+            uint64_t digit = static_cast<uint64_t> (*p++ - '0');
+            if(mantissa < UINT64_MAX / 10 || (mantissa == UINT64_MAX / 10 && digit <= UINT64_MAX % 10)) {
+                mantissa = mantissa * 10 + digit;
+            } else {
+                integer = false;
+                exact = exact && !digit;
+                if(exponent < 100000) {
+                    exponent++;
                 }
             }
         }
+    }
+    if(p < end && *p == '.') {
+        p++;
+        integer = false;
+        if(!json_digit(p, end)) {
+            return false;
+        }
+        while(json_digit(p, end)) {
+            uint64_t digit = static_cast<uint64_t> (*p++ - '0');
+            if(mantissa < UINT64_MAX / 10) {
+                mantissa = mantissa * 10 + digit;
+                // Only leading zeros can move the exponent that far
+                if(exponent > -100000) {
+                    exponent--;
+                }
+            } else {
+                exact = exact && !digit;
+            }
+        }
+    }
+    if(p < end && (*p == 'e' || *p == 'E')) {
+        p++;
+        integer = false;
+        bool minus = p < end && *p == '-';
+        if(p < end && (*p == '-' || *p == '+')) {
+            p++;
+        }
+        if(!json_digit(p, end)) {
+            return false;
+        }
+        int value = 0;
+        while(json_digit(p, end)) {
+            if(value < 100000) {
+                value = value * 10 + (*p - '0');
+            }
+            p++;
+        }
+        exponent += minus ? -value : value;
+    }
+    return true;
+}
+
+/*
+ * Floating point number with a 64-bit significand for the conversions of doubles without the locale
+ */
+struct DiyFp {
+    uint64_t f;
+    int e;
+};
+
+static DiyFp diyfp_mul(const DiyFp & x, const DiyFp & y) {
+    uint64_t x_lo = x.f & 0xFFFFFFFF;
+    uint64_t x_hi = x.f >> 32;
+    uint64_t y_lo = y.f & 0xFFFFFFFF;
+    uint64_t y_hi = y.f >> 32;
+    uint64_t lo_lo = x_lo * y_lo;
+    uint64_t lo_hi = x_lo * y_hi;
+    uint64_t hi_lo = x_hi * y_lo;
+    uint64_t hi_hi = x_hi * y_hi;
+    uint64_t middle = (lo_lo >> 32) + (lo_hi & 0xFFFFFFFF) + (hi_lo & 0xFFFFFFFF) + (static_cast<uint64_t> (1) << 31); // rounding
+    return {hi_hi + (lo_hi >> 32) + (hi_lo >> 32) + (middle >> 32), x.e + y.e + 64};
+}
 
+static DiyFp diyfp_normalize(DiyFp x) {
+#ifdef __GNUC__
+    int shift = __builtin_clzll(x.f);
+    x.f <<= shift;
+    x.e -= shift;
+#else
+    while(!(x.f >> 63)) {
+        x.f <<= 1;
+        x.e--;
     }
-    // read field id and move offset next msgpack value
-    return check_key_type(m_data[m_offset]) && msgpack_read(id);
+#endif
+    return x;
 }
 
-size_t Decoder::Read(KeyType id, uint8_t *data, size_t size) {
-    msgpack_unpacked msg;
-    msgpack_unpacked_init(&msg);
+struct CachedPower {
+    uint64_t f;
+    int e;
+    int k;
+};
 
-    if(FieldFind(id) && msgpack_unpack_next(&msg, m_data, m_size, &m_offset)) {
+/*
+ * Normalized 10^k for k = -348, -340, ... 324
+ */
+static const CachedPower grisu_powers[] = {
+    {0xFA8FD5A0081C0288, -1220, -348}, {0xBAAEE17FA23EBF76, -1193, -340}, {0x8B16FB203055AC76, -1166, -332},
+    {0xCF42894A5DCE35EA, -1140, -324}, {0x9A6BB0AA55653B2D, -1113, -316}, {0xE61ACF033D1A45DF, -1087, -308},
+    {0xAB70FE17C79AC6CA, -1060, -300}, {0xFF77B1FCBEBCDC4F, -1034, -292}, {0xBE5691EF416BD60C, -1007, -284},
+    {0x8DD01FAD907FFC3C, -980, -276}, {0xD3515C2831559A83, -954, -268}, {0x9D71AC8FADA6C9B5, -927, -260},
+    {0xEA9C227723EE8BCB, -901, -252}, {0xAECC49914078536D, -874, -244}, {0x823C12795DB6CE57, -847, -236},
+    {0xC21094364DFB5637, -821, -228}, {0x9096EA6F3848984F, -794, -220}, {0xD77485CB25823AC7, -768, -212},
+    {0xA086CFCD97BF97F4, -741, -204}, {0xEF340A98172AACE5, -715, -196}, {0xB23867FB2A35B28E, -688, -188},
+    {0x84C8D4DFD2C63F3B, -661, -180}, {0xC5DD44271AD3CDBA, -635, -172}, {0x936B9FCEBB25C996, -608, -164},
+    {0xDBAC6C247D62A584, -582, -156}, {0xA3AB66580D5FDAF6, -555, -148}, {0xF3E2F893DEC3F126, -529, -140},
+    {0xB5B5ADA8AAFF80B8, -502, -132}, {0x87625F056C7C4A8B, -475, -124}, {0xC9BCFF6034C13053, -449, -116},
+    {0x964E858C91BA2655, -422, -108}, {0xDFF9772470297EBD, -396, -100}, {0xA6DFBD9FB8E5B88F, -369, -92},
+    {0xF8A95FCF88747D94, -343, -84}, {0xB94470938FA89BCF, -316, -76}, {0x8A08F0F8BF0F156B, -289, -68},
+    {0xCDB02555653131B6, -263, -60}, {0x993FE2C6D07B7FAC, -236, -52}, {0xE45C10C42A2B3B06, -210, -44},
+    {0xAA242499697392D3, -183, -36}, {0xFD87B5F28300CA0E, -157, -28}, {0xBCE5086492111AEB, -130, -20},
+    {0x8CBCCC096F5088CC, -103, -12}, {0xD1B71758E219652C, -77, -4}, {0x9C40000000000000, -50, 4},
+    {0xE8D4A51000000000, -24, 12}, {0xAD78EBC5AC620000, 3, 20}, {0x813F3978F8940984, 30, 28},
+    {0xC097CE7BC90715B3, 56, 36}, {0x8F7E32CE7BEA5C70, 83, 44}, {0xD5D238A4ABE98068, 109, 52},
+    {0x9F4F2726179A2245, 136, 60}, {0xED63A231D4C4FB27, 162, 68}, {0xB0DE65388CC8ADA8, 189, 76},
+    {0x83C7088E1AAB65DB, 216, 84}, {0xC45D1DF942711D9A, 242, 92}, {0x924D692CA61BE758, 269, 100},
+    {0xDA01EE641A708DEA, 295, 108}, {0xA26DA3999AEF774A, 322, 116}, {0xF209787BB47D6B85, 348, 124},
+    {0xB454E4A179DD1877, 375, 132}, {0x865B86925B9BC5C2, 402, 140}, {0xC83553C5C8965D3D, 428, 148},
+    {0x952AB45CFA97A0B3, 455, 156}, {0xDE469FBD99A05FE3, 481, 164}, {0xA59BC234DB398C25, 508, 172},
+    {0xF6C69A72A3989F5C, 534, 180}, {0xB7DCBF5354E9BECE, 561, 188}, {0x88FCF317F22241E2, 588, 196},
+    {0xCC20CE9BD35C78A5, 614, 204}, {0x98165AF37B2153DF, 641, 212}, {0xE2A0B5DC971F303A, 667, 220},
+    {0xA8D9D1535CE3B396, 694, 228}, {0xFB9B7CD9A4A7443C, 720, 236}, {0xBB764C4CA7A44410, 747, 244},
+    {0x8BAB8EEFB6409C1A, 774, 252}, {0xD01FEF10A657842C, 800, 260}, {0x9B10A4E5E9913129, 827, 268},
+    {0xE7109BFBA19C0C9D, 853, 276}, {0xAC2820D9623BF429, 880, 284}, {0x80444B5E7AA7CF85, 907, 292},
+    {0xBF21E44003ACDD2D, 933, 300}, {0x8E679C2F5E44FF8F, 960, 308}, {0xD433179D9C8CB841, 986, 316},
+    {0x9E19DB92B4E31BA9, 1013, 324}
+};
 
-        // Must use only fixed static buffer
-        assert(msg.zone == nullptr);
+static const double json_pow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
 
-        msgpack_object value = msg.data;
-        if(value.type == MSGPACK_OBJECT_BIN) {
-            if(value.via.bin.size <= size) {
-                memcpy(data, value.via.bin.ptr, value.via.bin.size);
-                return value.via.bin.size;
-            }
+/*
+ * Normalized 10^1 ... 10^7 for the steps between the cached powers
+ */
+static const DiyFp json_adjust[] = {
+    {0xA000000000000000, -60}, {0xC800000000000000, -57}, {0xFA00000000000000, -54}, {0x9C40000000000000, -50},
+    {0xC350000000000000, -47}, {0xF424000000000000, -44}, {0x9896800000000000, -40}
+};
+
+/*
+ * Double from the significand and the binary exponent of its last bit, the significand can be one bit longer
+ * after rounding up. Subnormal values have the exponent of the smallest one.
+ */
+static double json_double(uint64_t significand, int exponent) {
+    const int digits = std::numeric_limits<double>::digits;
+    const uint64_t hidden = static_cast<uint64_t> (1) << (digits - 1);
+    if(significand >> digits) {
+        significand >>= 1;
+        exponent++;
+    }
+    uint64_t bits = significand;
+    if(significand & hidden) {
+        uint64_t biased = static_cast<uint64_t> (exponent + std::numeric_limits<double>::max_exponent - 1 + digits - 1);
+        if(biased >= 2 * std::numeric_limits<double>::max_exponent - 1) {
+            return std::numeric_limits<double>::infinity();
         }
+        bits = (biased << (digits - 1)) | (significand & (hidden - 1));
     }
-    return 0;
+    double value;
+    memcpy(&value, &bits, sizeof (value));
+    return value;
 }
 
-const char * Decoder::ReadAsString(KeyType id, size_t *length) {
-    msgpack_unpacked msg;
-    msgpack_unpacked_init(&msg);
+/*
+ * Mantissa * 10^exponent with the error bounds of the multiplications (as in double-conversion).
+ * Returns false if the value is too close to the middle between two doubles,
+ * the value is the lower one of them then.
+ */
+static bool json_diyfp(uint64_t mantissa, int exponent, bool exact, double & value) {
+    const size_t count = sizeof (grisu_powers) / sizeof (grisu_powers[0]);
+    if(exponent < grisu_powers[0].k) {
+        // Below the half of the smallest subnormal
+        value = 0;
+        return true;
+    } else if(exponent >= grisu_powers[count - 1].k + 8) {
+        value = std::numeric_limits<double>::infinity();
+        return true;
+    }
+    // Errors in units of 1/8 of the last bit, digits are dropped only from the long mantissa, so the shift is small
+    const int denominator = 8;
+    DiyFp input = diyfp_normalize({mantissa, 0});
+    uint64_t error = exact ? 0 : static_cast<uint64_t> (denominator) << -input.e;
+    const CachedPower & cached = grisu_powers[(exponent - grisu_powers[0].k) / 8];
+    int adjust = exponent - cached.k;
+    if(adjust) {
+        input = diyfp_mul(input, json_adjust[adjust - 1]);
+        error += denominator / 2;
+    }
+    input = diyfp_mul(input, {cached.f, cached.e});
+    error += denominator / 2 + (error ? 1 : 0) + denominator / 2;
+    int old_e = input.e;
+    input = diyfp_normalize(input);
+    error <<= old_e - input.e;
 
-    if(FieldFind(id) && msgpack_unpack_next(&msg, m_data, m_size, &m_offset)) {
+    int magnitude = 64 + input.e; // the value is below 2^magnitude
+    if(magnitude > std::numeric_limits<double>::max_exponent) {
+        value = std::numeric_limits<double>::infinity();
+        return true;
+    }
+    // Bits of the double at this magnitude, subnormal values have less of them
+    const int smallest = std::numeric_limits<double>::min_exponent - std::numeric_limits<double>::digits;
+    int size = std::max(0, std::min(std::numeric_limits<double>::digits, magnitude - smallest));
+    int precision = 64 - size;
+    uint64_t significand = precision < 64 ? input.f >> precision : 0;
+    int last = input.e + precision;
+    bool decided = false;
+    if(precision + 3 < 64) {
+        const uint64_t half = static_cast<uint64_t> (denominator) << (precision - 1);
+        uint64_t bits = (input.f & ((static_cast<uint64_t> (1) << precision) - 1)) * denominator;
+        decided = error < half && (bits <= half - error || bits >= half + error);
+        if(decided && bits >= half + error) {
+            significand++;
+        }
+    }
+    value = json_double(significand, last);
+    return decided;
+}
 
-        // Must use only fixed static buffer
-        assert(msg.zone == nullptr);
+/*
+ * Unsigned integer of fixed size for the exact comparison in json_bignum
+ */
+struct JsonBignum {
+    static const size_t capacity = 88; // 2816 bits, the numbers of 780 digits take up to 2600 bits
+    uint32_t digits[capacity];
+    size_t size;
+};
 
-        msgpack_object value = msg.data;
-        if(value.type == MSGPACK_OBJECT_STR && value.via.str.size) {
-            if(length) {
-                *length = value.via.str.size;
-            }
-            return value.via.str.ptr;
+static bool bignum_mul(JsonBignum & x, uint32_t factor, uint32_t add) {
+    uint64_t carry = add;
+    for (size_t i = 0; i < x.size; i++) {
+        carry += static_cast<uint64_t> (x.digits[i]) * factor;
+        x.digits[i] = static_cast<uint32_t> (carry);
+        carry >>= 32;
+    }
+    if(carry) {
+        if(x.size == JsonBignum::capacity) {
+            return false;
         }
+        x.digits[x.size++] = static_cast<uint32_t> (carry);
     }
-    if(length) {
-        *length = 0;
+    return true;
+}
+
+static bool bignum_pow5(JsonBignum & x, int power) {
+    const uint32_t pow5_13 = 1220703125;
+    for (; power >= 13; power -= 13) {
+        if(!bignum_mul(x, pow5_13, 0)) {
+            return false;
+        }
     }
-    return nullptr;
+    uint32_t factor = 1;
+    for (; power > 0; power--) {
+        factor *= 5;
+    }
+    return bignum_mul(x, factor, 0);
+}
+
+static bool bignum_shift(JsonBignum & x, int bits) {
+    if(!x.size || !bits) {
+        return true;
+    }
+    size_t words = static_cast<size_t> (bits / 32);
+    int rest = bits % 32;
+    if(x.size + words + 1 > JsonBignum::capacity) {
+        return false;
+    }
+    x.digits[x.size + words] = 0;
+    for (size_t i = x.size; i-- > 0;) {
+        uint64_t value = static_cast<uint64_t> (x.digits[i]) << rest;
+        x.digits[i + words + 1] |= static_cast<uint32_t> (value >> 32);
+        x.digits[i + words] = static_cast<uint32_t> (value);
+    }
+    for (size_t i = 0; i < words; i++) {
+        x.digits[i] = 0;
+    }
+    x.size += words + 1;
+    if(!x.digits[x.size - 1]) {
+        x.size--;
+    }
+    return true;
+}
+
+static int bignum_compare(const JsonBignum & a, const JsonBignum & b) {
+    if(a.size != b.size) {
+        return a.size < b.size ? -1 : 1;
+    }
+    for (size_t i = a.size; i-- > 0;) {
+        if(a.digits[i] != b.digits[i]) {
+            return a.digits[i] < b.digits[i] ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Correct rounding of the number text when json_diyfp can not decide it, the guess is the lower double.
+ * The number is compared exactly with the middle between the guess and the next double, without the locale
+ * and memory allocation. The middle has at most 767 significant digits, so the digits after the first 780
+ * only tell if the number is above it.
+ */
+static bool json_bignum(const char *p, const char *end, double & value) {
+    const size_t max_digits = 780;
+    JsonBignum number;
+    number.size = 0;
+    size_t digits = 0;
+    bool sticky = false;
+    long exponent = 0;
+    bool point = false;
+    for (; p < end && *p != 'e' && *p != 'E'; p++) {
+        if(*p == '.') {
+            point = true;
+        } else if(digits < max_digits) {
+            if(digits || *p != '0') {
+                digits++;
+                if(!bignum_mul(number, 10, static_cast<uint32_t> (*p - '0'))) {
+                    return false;
+                }
+            }
+            exponent -= point ? 1 : 0;
+        } else {
+            sticky = sticky || *p != '0';
+            exponent += point ? 0 : 1;
+        }
+    }
+    if(p < end) {
+        p++;
+        bool minus = *p == '-';
+        long power = 0;
+        for (p += (*p == '-' || *p == '+') ? 1 : 0; p < end; p++) {
+            if(power < 100000) {
+                power = power * 10 + (*p - '0');
+            }
+        }
+        exponent += minus ? -power : power;
+    }
+
+    // The middle is (2 * significand + 1) * 2^(last - 1)
+    const int digits_bits = std::numeric_limits<double>::digits - 1;
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof (bits));
+    uint64_t significand = bits & ((static_cast<uint64_t> (1) << digits_bits) - 1);
+    int biased = static_cast<int> (bits >> digits_bits);
+    int last = std::numeric_limits<double>::min_exponent - std::numeric_limits<double>::digits;
+    if(biased) {
+        significand |= static_cast<uint64_t> (1) << digits_bits;
+        last += biased - 1;
+    }
+    JsonBignum middle;
+    uint64_t twice = 2 * significand + 1;
+    middle.digits[0] = static_cast<uint32_t> (twice);
+    middle.digits[1] = static_cast<uint32_t> (twice >> 32);
+    middle.size = middle.digits[1] ? 2 : 1;
+
+    // number * 5^exponent * 2^exponent against middle * 2^(last - 1)
+    if(exponent < -100000 || exponent > 100000) {
+        return false;
+    }
+    int power10 = static_cast<int> (exponent);
+    int power2 = last - 1 - power10;
+    if(!(power10 >= 0 ? bignum_pow5(number, power10) : bignum_pow5(middle, -power10))
+            || !(power2 >= 0 ? bignum_shift(middle, power2) : bignum_shift(number, -power2))) {
+        return false;
+    }
+    int compare = bignum_compare(number, middle);
+    if(compare > 0 || (compare == 0 && (sticky || (significand & 1)))) {
+        value = json_double(significand + 1, last);
+    }
+    return true;
+}
+
+bool Encoder::WriteJson(const char *json, size_t size, size_t *parsed) {
+    size_t temp = m_used;
+    const char *p = json;
+    bool result = json && write_json(p, json + size);
+    if(parsed) {
+        *parsed = result ? static_cast<size_t> (p - json) : 0;
+    }
+    if(!result) {
+        m_used = temp;
+    }
+    return result;
+}
+
+bool Encoder::write_json(const char * & p, const char *end) {
+    if(!json_expect(p, end, '{')) {
+        return false;
+    }
+    if(json_expect(p, end, '}')) {
+        return true;
+    }
+    do {
+        // Key is a decimal number in quotes
+        if(!json_expect(p, end, '"')) {
+            return false;
+        }
+        uint64_t id = 0;
+        const char *start = p;
+        while(p < end && *p >= '0' && *p <= '9' && id <= static_cast<KeyType> (-1)) {
+            id = id * 10 + static_cast<uint64_t> (*p++ - '0');
+        }
+        if(p == start || !id || id > static_cast<KeyType> (-1) || p >= end || *p++ != '"' || !json_expect(p, end, ':')) {
+            return false;
+        }
+        json_space(p, end);
+        if(!write_json_value(static_cast<KeyType> (id), p, end)) {
+            return false;
+        }
+    } while(json_expect(p, end, ','));
+    return json_expect(p, end, '}');
+}
+
+bool Encoder::write_json_value(KeyType id, const char * & p, const char *end) {
+    if(p >= end) {
+        return false;
+    }
+    if(*p == '"') {
+        // String with the null char, the size is counted in the first pass
+        const char *start = ++p;
+        size_t len = 0;
+        if(!json_string(p, end, [&len](const char *, size_t size) {
+                len += size;
+                return true;
+            })) {
+            return false;
+        }
+        p = start;
+        return msgpack_write(id) && msgpack_pack_str(&m_pk, len + 1) == 0
+                && json_string(p, end, [this](const char *data, size_t size) {
+                    return callback_func(m_data, data, size) == 0;
+                })
+                && callback_func(m_data, "", 1) == 0;
+    } else if(*p == '{') {
+        // Blob {"base64": "..."}
+        p++;
+        if(!json_expect(p, end, '"') || !json_literal(p, end, "base64\"") || !json_expect(p, end, ':') || !json_expect(p, end, '"')) {
+            return false;
+        }
+        const char *start = p;
+        while(p < end && base64_value(*p) >= 0) {
+            p++;
+        }
+        size_t chars = static_cast<size_t> (p - start);
+        while(p < end && *p == '=') {
+            p++;
+        }
+        if(p >= end || *p++ != '"' || !json_expect(p, end, '}') || chars % 4 == 1) {
+            return false;
+        }
+        if(!msgpack_write(id) || msgpack_pack_bin(&m_pk, chars * 6 / 8) != 0) {
+            return false;
+        }
+        char data[3];
+        for (size_t i = 0; i < chars; i += 4) {
+            uint32_t bits = 0;
+            size_t count = std::min(static_cast<size_t> (4), chars - i);
+            for (size_t j = 0; j < 4; j++) {
+                bits = (bits << 6) | (j < count ? static_cast<uint32_t> (base64_value(start[i + j])) : 0);
+            }
+            data[0] = static_cast<char> (bits >> 16);
+            data[1] = static_cast<char> (bits >> 8);
+            data[2] = static_cast<char> (bits);
+            if(callback_func(m_data, data, count - 1) != 0) {
+                return false;
+            }
+        }
+        return true;
+    } else if(*p == '[') {
+        // Array of numbers, the count is found in the first pass
+        p++;
+        const char *start = p;
+        size_t count = 0;
+        if(!json_expect(p, end, ']')) {
+            do {
+                json_space(p, end);
+                if(!json_skip(p, end)) {
+                    return false;
+                }
+                count++;
+            } while(json_expect(p, end, ','));
+            if(!json_expect(p, end, ']')) {
+                return false;
+            }
+        }
+        p = start;
+        if(!msgpack_write(id) || msgpack_pack_array(&m_pk, count) != 0) {
+            return false;
+        }
+        for (size_t i = 0; i < count; i++) {
+            json_space(p, end);
+            // NaN and infinity are written by JsonWriter as null
+            if(json_literal(p, end, "null") ? !msgpack_write(std::numeric_limits<double>::quiet_NaN()) : !write_json_scalar(p, end)) {
+                return false;
+            }
+            if(!json_expect(p, end, i + 1 < count ? ',' : ']')) {
+                return false;
+            }
+        }
+        return count || json_expect(p, end, ']');
+    } else if(json_literal(p, end, "null")) {
+        return true;
+    }
+    return msgpack_write(id) && write_json_scalar(p, end);
+}
+
+bool Encoder::write_json_scalar(const char * & p, const char *end) {
+    if(json_literal(p, end, "true")) {
+        return msgpack_write(true);
+    } else if(json_literal(p, end, "false")) {
+        return msgpack_write(false);
+    }
+    bool negative = p < end && *p == '-';
+    if(negative) {
+        p++;
+    }
+    const char *start = p;
+    uint64_t mantissa;
+    int exponent;
+    bool integer;
+    bool exact;
+    if(!json_number(p, end, mantissa, exponent, integer, exact)) {
+        return false;
+    }
+    if(integer) {
+        if(!negative) {
+            return msgpack_write(mantissa);
+        } else if(mantissa <= static_cast<uint64_t> (INT64_MAX) + 1) {
+            return msgpack_write(static_cast<int64_t> (0 - mantissa));
+        }
+    }
+    // Floating point or out of the integer range.
+    // If the mantissa and the power of ten are exact doubles, the result is rounded correctly (Clinger's fast path).
+    double value;
+    if(exact && mantissa <= (static_cast<uint64_t> (1) << 53) && exponent >= -22 && exponent <= 22) {
+        double temp = static_cast<double> (mantissa);
+        value = exponent < 0 ? temp / json_pow10[-exponent] : temp * json_pow10[exponent];
+    } else if(!mantissa) {
+        value = 0;
+    } else if(!json_diyfp(mantissa, exponent, exact, value) && !json_bignum(start, p, value)) {
+        return false;
+    }
+    return std::isfinite(value) && msgpack_write(negative ? -value : value);
+}
+
+/*
+ * Form of a column for WriteBatch: packed values of one kind or encoded values with the offset table
+ */
+struct ColumnForm {
+    size_t kind;
+    size_t width;
+    size_t size; ///< Total size of the encoded values
+    uint64_t max; ///< Maximum of non-negative integers
+    int64_t min; ///< Minimum of negative integers
+};
+
+static inline bool column_scalar(const uint8_t *data, size_t size, msgpack_object & value) {
+    msgpack_unpacked msg;
+    msgpack_unpacked_init(&msg);
+    size_t offset = 0;
+    if(msgpack_unpack_next(&msg, reinterpret_cast<const char *> (data), size, &offset) <= 0 || offset != size) {
+        return false;
+    }
+    assert(msg.zone == nullptr);
+    value = msg.data;
+    return true;
+}
+
+static inline size_t column_width(uint64_t max) {
+    return max <= 0xFF ? 1 : (max <= 0xFFFF ? 2 : (max <= 0xFFFFFFFF ? 4 : 8));
+}
+
+static void column_add(ColumnForm & form, const uint8_t *data, size_t size, bool first) {
+    form.size += size;
+    msgpack_object value;
+    size_t kind = BatchDecoder::ColumnEncoded;
+    size_t width = 1;
+    if(column_scalar(data, size, value)) {
+        if(value.type == MSGPACK_OBJECT_POSITIVE_INTEGER) {
+            kind = BatchDecoder::ColumnUnsigned;
+            form.max = std::max(form.max, value.via.u64);
+        } else if(value.type == MSGPACK_OBJECT_NEGATIVE_INTEGER) {
+            kind = BatchDecoder::ColumnSigned;
+            form.min = std::min(form.min, value.via.i64);
+        } else if(value.type == MSGPACK_OBJECT_BOOLEAN) {
+            kind = BatchDecoder::ColumnBool;
+        } else if(value.type == MSGPACK_OBJECT_FLOAT32) {
+            kind = BatchDecoder::ColumnFloat;
+            width = sizeof (float);
+        } else if(value.type == MSGPACK_OBJECT_FLOAT || value.type == MSGPACK_OBJECT_FLOAT64) {
+            kind = BatchDecoder::ColumnFloat;
+            width = sizeof (double);
+        }
+    }
+    if(first) {
+        form.kind = kind;
+        form.width = width;
+    } else if(form.kind == BatchDecoder::ColumnUnsigned && kind == BatchDecoder::ColumnSigned) {
+        form.kind = kind;
+    } else if(form.kind != kind && !(form.kind == BatchDecoder::ColumnSigned && kind == BatchDecoder::ColumnUnsigned)) {
+        form.kind = BatchDecoder::ColumnEncoded;
+    } else if(form.width != width) {
+        // float32 and float64 in one column
+        form.kind = BatchDecoder::ColumnEncoded;
+    }
+}
+
+static void column_finish(ColumnForm & form) {
+    if(form.kind == BatchDecoder::ColumnUnsigned) {
+        form.width = column_width(form.max);
+    } else if(form.kind == BatchDecoder::ColumnSigned) {
+        // The width for both the minimum and the maximum as two's complement
+        uint64_t magnitude = std::max(form.max, static_cast<uint64_t> (-(form.min + 1)));
+        if(magnitude > static_cast<uint64_t> (INT64_MAX)) {
+            form.kind = BatchDecoder::ColumnEncoded;
+        } else {
+            form.width = column_width(magnitude << 1);
+        }
+    }
+    if(form.kind == BatchDecoder::ColumnEncoded) {
+        form.width = column_width(form.size);
+    }
+}
+
+/*
+ * Packed bits of an encoded value, the column form is checked by column_add
+ */
+static uint64_t column_pack(const ColumnForm & form, const uint8_t *data, size_t size) {
+    msgpack_object value;
+    if(!column_scalar(data, size, value)) {
+        return 0;
+    }
+    if(value.type == MSGPACK_OBJECT_POSITIVE_INTEGER) {
+        return value.via.u64;
+    } else if(value.type == MSGPACK_OBJECT_NEGATIVE_INTEGER) {
+        return static_cast<uint64_t> (value.via.i64);
+    } else if(value.type == MSGPACK_OBJECT_BOOLEAN) {
+        return value.via.boolean ? 1 : 0;
+    } else if(form.width == sizeof (float)) {
+        float single = static_cast<float> (value.via.f64);
+        uint32_t bits;
+        memcpy(&bits, &single, sizeof (bits));
+        return bits;
+    }
+    uint64_t bits;
+    memcpy(&bits, &value.via.f64, sizeof (bits));
+    return bits;
+}
+
+bool Encoder::column_write(uint64_t bits, size_t width) {
+    char data[8];
+    for (size_t i = 0; i < width; i++) {
+        data[i] = static_cast<char> (bits >> (i * 8));
+    }
+    return callback_func(m_data, data, width) == 0;
+}
+
+bool Encoder::WriteBatch(Decoder * records[], size_t count) {
+    if(!records || !count) {
+        return false;
+    }
+    size_t temp = m_used;
+    KeyType id;
+    const uint8_t *value;
+    size_t size;
+
+    // All records must have the same number of fields as the first one
+    size_t fields = 0;
+    for (size_t i = 0; i < count; i++) {
+        size_t found = 0;
+        records[i]->Reset();
+        while(records[i]->FieldNext(id)) {
+            found++;
+        }
+        // A decode error is not the end of the record
+        if(!records[i]->FieldEnd()) {
+            return false;
+        }
+        records[i]->Reset();
+        if(i == 0) {
+            fields = found;
+        } else if(found != fields) {
+            return false;
+        }
+    }
+    if(!fields || !msgpack_write(count)) {
+        m_used = temp;
+        return false;
+    }
+
+    Decoder & first = *records[0];
+    while(first.FieldNext(id)) {
+        // Find the field in all records and choose the column form
+        ColumnForm form = ColumnForm();
+        for (size_t i = 0; i < count; i++) {
+            if((i && !records[i]->FieldSeek(id)) || !records[i]->FieldValue(value, size)) {
+                m_used = temp;
+                return false;
+            }
+            column_add(form, value, size, i == 0);
+        }
+        column_finish(form);
+
+        size_t column = 1 + count * form.width + (form.kind == BatchDecoder::ColumnEncoded ? form.size : 0);
+        char tag = static_cast<char> (form.kind << 4 | form.width);
+        if(!msgpack_write(id) || msgpack_pack_bin(&m_pk, column) != 0 || callback_func(m_data, &tag, 1) != 0) {
+            m_used = temp;
+            return false;
+        }
+        // The inner pointers stay at the field values
+        size_t offset = 0;
+        for (size_t i = 0; i < count; i++) {
+            records[i]->FieldValue(value, size);
+            if(form.kind == BatchDecoder::ColumnEncoded) {
+                // End offset of the value
+                offset += size;
+                if(!column_write(offset, form.width)) {
+                    m_used = temp;
+                    return false;
+                }
+            } else if(!column_write(column_pack(form, value, size), form.width)) {
+                m_used = temp;
+                return false;
+            }
+        }
+        for (size_t i = 0; form.kind == BatchDecoder::ColumnEncoded && i < count; i++) {
+            if(!records[i]->FieldValue(value, size) || callback_func(m_data, reinterpret_cast<const char *> (value), size) != 0) {
+                m_used = temp;
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool Encoder::WriteRecord(const BatchDecoder & batch, size_t index) {
+    if(index >= batch.GetCount()) {
+        return false;
+    }
+    size_t temp = m_used;
+    FieldRef column = FieldRef();
+    uint8_t buffer[BatchDecoder::ValueSize];
+    const uint8_t *value;
+    size_t size;
+    while(batch.FieldNext(column)) {
+        if(!batch.ColumnValue(column, index, value, size, buffer) || !WriteRaw(column.id, value, size)) {
+            m_used = temp;
+            return false;
+        }
+    }
+    if(!batch.FieldEnd(column)) {
+        m_used = temp;
+        return false;
+    }
+    return true;
+}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wfloat-equal" // exact comparison is intended here
+
+bool Encoder::msgpack_write_compact(double value) {
+    // Integers up to 32 bits are never longer than float32 (5 bytes).
+    if(value >= -2147483648.0 && value <= 4294967295.0) {
+        if(value >= 0) {
+            if(std::signbit(value)) {
+                // Negative zero is stored as float to keep the sign
+                return msgpack_pack_float(&m_pk, static_cast<float> (value)) == 0;
+            }
+            uint32_t temp = static_cast<uint32_t> (value);
+            if(static_cast<double> (temp) == value) {
+                return msgpack_pack_uint32(&m_pk, temp) == 0;
+            }
+        } else {
+            int32_t temp = static_cast<int32_t> (value);
+            if(static_cast<double> (temp) == value) {
+                return msgpack_pack_int32(&m_pk, temp) == 0;
+            }
+        }
+    }
+    // NaN fails the comparison and is stored as float64
+    float single = static_cast<float> (value);
+    if(static_cast<double> (single) == value) {
+        return msgpack_pack_float(&m_pk, single) == 0;
+    }
+    return msgpack_pack_double(&m_pk, value) == 0;
+}
+
+#pragma GCC diagnostic pop
+
+int Encoder::callback_func(void* data, const char* buf, size_t len) {
+    assert(m_data == data);
+    if(m_used + len <= m_size) {
+        if(buf && len) {
+            memcpy(&m_data[m_used], buf, len);
+            m_used += len;
+        } else {
+            assert(buf == nullptr && len == 0);
+        }
+        return 0;
+    }
+    return -1;
+}
+
+int Encoder::msgpack_callback(void* data, const char* buf, size_t len, void* callback_param) {
+    Encoder * obj = static_cast<Encoder *> (callback_param);
+    if(obj) {
+        return obj->callback_func(data, buf, len);
+    }
+    return -1;
+}
+
+/*
+ * 
+ */
+Decoder::Decoder() : Decoder(static_cast<uint8_t *> (nullptr), 0) {
+}
+
+Decoder::Decoder(uint8_t *data, size_t size) {
+    AssignBuffer(data, size);
+}
+
+Decoder::Decoder(const uint8_t *data, size_t size) {
+    AssignBuffer(const_cast<uint8_t *> (data), size);
+}
+
+Decoder::~Decoder() {
+}
+
+bool Decoder::AssignBuffer(uint8_t *data, size_t size) {
+    const_cast<char*&> (m_data) = reinterpret_cast<char *> (data);
+    m_size = size;
+    m_offset = 0;
+    return data && size;
+}
+
+bool Decoder::FieldFind(KeyType id) {
+    if(!m_data || !m_size || !check_key_type(m_data[0])) {
+        return false;
+    }
+    m_offset = 0;
+    KeyType field_id;
+    while(FieldNext(field_id)) {
+        if(field_id == id) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool Decoder::FieldNext(KeyType & id) {
+    if(!m_data || !m_size || m_offset >= m_size) {
+        return false;
+    }
+    if(m_offset != 0) {
+        // Skip field data
+        if(!field_skip()) {
+            return false;
+        }
+    }
+    // read field id and move offset next msgpack value
+    return field_key(m_offset, id);
+}
+
+bool Decoder::FieldSeek(KeyType id) {
+    size_t start = m_offset;
+    KeyType field_id;
+    while(FieldNext(field_id)) {
+        if(field_id == id) {
+            return true;
+        }
+    }
+    if(start == 0) {
+        return false;
+    }
+    // Continue from the beginning of the buffer up to the start field
+    m_offset = 0;
+    while(FieldNext(field_id)) {
+        if(field_id == id) {
+            return true;
+        }
+        if(m_offset >= start) {
+            break;
+        }
+    }
+    return false;
+}
+
+bool Decoder::FieldValue(const uint8_t * & data, size_t & size) {
+    if(!m_data || !m_size || m_offset == 0 || m_offset >= m_size) {
+        return false;
+    }
+    size_t temp = m_offset;
+    if(!field_skip()) {
+        m_offset = temp;
+        return false;
+    }
+    data = reinterpret_cast<const uint8_t *> (&m_data[temp]);
+    size = m_offset - temp;
+    m_offset = temp;
+    return true;
+}
+
+bool Decoder::field_key(size_t & offset, KeyType & id) const {
+    size_t next = offset;
+    if(next < m_size && check_key_type(m_data[next]) && msgpack_read(next, id)) {
+        offset = next;
+        return true;
+    }
+    return false;
+}
+
+bool Decoder::field_skip(size_t & start) const {
+    msgpack_unpacked msg;
+    msgpack_unpacked_init(&msg);
+
+    // The offset is not changed on error, so FieldEnd sees the position of the error
+    size_t offset = start;
+
+    // Truncated data is an error too
+    if(msgpack_unpack_next(&msg, m_data, m_size, &offset) <= 0) {
+        return false;
+    }
+
+    assert(msg.zone == nullptr);
+
+    // if the field data is an array, skip all its elements
+    msgpack_object array = msg.data;
+    if(array.type == MSGPACK_OBJECT_ARRAY) {
+        size_t count = array.via.array.size;
+        for (size_t i = 0; i < count; i++) {
+            if(msgpack_unpack_next(&msg, m_data, m_size, &offset) <= 0) {
+                return false;
+            }
+            // Each of the remaining elements takes at least one byte
+            if(offset + (count - i - 1) > m_size) {
+                return false;
+            }
+        }
+    }
+    start = offset;
+    return true;
+}
+
+size_t Decoder::Read(KeyType id, uint8_t *data, size_t size) {
+    return FieldFind(id) ? read_blob(m_offset, data, size) : 0;
+}
+
+const char * Decoder::ReadAsString(KeyType id, size_t *length) {
+    return read_string(FieldFind(id) ? m_offset : 0, length);
+}
+
+size_t Decoder::read_blob(size_t offset, uint8_t *data, size_t size) const {
+    msgpack_unpacked msg;
+    msgpack_unpacked_init(&msg);
+
+    if(msgpack_unpack_next(&msg, m_data, m_size, &offset) > 0) {
+
+        // Must use only fixed static buffer
+        assert(msg.zone == nullptr);
+
+        msgpack_object value = msg.data;
+        if(value.type == MSGPACK_OBJECT_BIN) {
+            if(value.via.bin.size <= size) {
+                memcpy(data, value.via.bin.ptr, value.via.bin.size);
+                return value.via.bin.size;
+            }
+        }
+    }
+    return 0;
+}
+
+const char * Decoder::read_string(size_t offset, size_t *length) const {
+    msgpack_unpacked msg;
+    msgpack_unpacked_init(&msg);
+
+    // Zero offset is the key of the first field and never a value
+    if(offset && msgpack_unpack_next(&msg, m_data, m_size, &offset) > 0) {
+
+        // Must use only fixed static buffer
+        assert(msg.zone == nullptr);
+
+        msgpack_object value = msg.data;
+        if(value.type == MSGPACK_OBJECT_STR && value.via.str.size) {
+            if(length) {
+                *length = value.via.str.size;
+            }
+            return value.via.str.ptr;
+        }
+    }
+    if(length) {
+        *length = 0;
+    }
+    return nullptr;
+}
+
+FieldRef Decoder::Lookup(KeyType id) const {
+    FieldRef field = FieldRef();
+    if(m_data && m_size && check_key_type(m_data[0])) {
+        while(FieldNext(field)) {
+            if(field.id == id) {
+                return field;
+            }
+        }
+    }
+    field = FieldRef();
+    field.id = id;
+    return field;
+}
+
+Decoder Decoder::OpenGroup(const FieldRef & field) const {
+    if(field) {
+        msgpack_unpacked msg;
+        msgpack_unpacked_init(&msg);
+
+        size_t offset = field.offset;
+        if(msgpack_unpack_next(&msg, m_data, m_size, &offset) > 0) {
+
+            assert(msg.zone == nullptr);
+
+            msgpack_object value = msg.data;
+            if(value.type == MSGPACK_OBJECT_BIN) {
+                return Decoder(reinterpret_cast<const uint8_t *> (value.via.bin.ptr), value.via.bin.size);
+            }
+        }
+    }
+    return Decoder();
+}
+
+bool Decoder::FieldNext(FieldRef & field) const {
+    if(!m_data || !m_size) {
+        return false;
+    }
+    size_t offset = field.offset ? field.offset + field.size : 0;
+    KeyType id;
+    if(!field_key(offset, id)) {
+        return false;
+    }
+    size_t end = offset;
+    if(!field_skip(end)) {
+        return false;
+    }
+    field.id = id;
+    field.offset = offset;
+    field.size = end - offset;
+    return true;
+}
+
+bool Decoder::FieldEnd(const FieldRef & field) const {
+    return field_end(field.offset ? field.offset + field.size : 0);
+}
+
+bool Decoder::FieldEnd() const {
+    return field_end(m_offset);
+}
+
+bool Decoder::field_end(size_t offset) const {
+    if(!m_data || offset >= m_size) {
+        return true;
+    }
+    // The rest of the buffer can be zero padding or the cleared flash memory, FieldFind stops at them too
+    uint8_t value = static_cast<uint8_t> (m_data[offset]);
+    return value == 0x00 || value == 0xFF;
+}
+
+/*
+ *
+ */
+Arena::Arena(uint8_t *data, size_t size) : m_data(data), m_size(data ? size : 0), m_used(0) {
+}
+
+void * Arena::Allocate(size_t size, size_t align) {
+    size_t pad = (align - reinterpret_cast<uintptr_t> (m_data + m_used) % align) % align;
+    if(!size || m_used + pad + size > m_size) {
+        return nullptr;
+    }
+    void *result = m_data + m_used + pad;
+    m_used += pad + size;
+    return result;
+}
+
+/*
+ *
+ */
+BatchDecoder::BatchDecoder(const uint8_t *data, size_t size) : Decoder(data, size), m_count(0) {
+    // The number of records is followed by the columns
+    size_t offset = 0;
+    size_t count;
+    if(data && size && msgpack_read(offset, count) && offset < size) {
+        m_count = count;
+        AssignBuffer(const_cast<uint8_t *> (data + offset), size - offset);
+    } else {
+        AssignBuffer(nullptr, 0);
+    }
+}
+
+bool BatchDecoder::column_range(const FieldRef & column, size_t & begin, size_t & end) const {
+    if(!column) {
+        return false;
+    }
+    msgpack_unpacked msg;
+    msgpack_unpacked_init(&msg);
+
+    const char *data = reinterpret_cast<const char *> (GetBuffer());
+    size_t offset = column.offset;
+    if(msgpack_unpack_next(&msg, data, GetSize(), &offset) > 0) {
+
+        assert(msg.zone == nullptr);
+
+        msgpack_object value = msg.data;
+        if(value.type == MSGPACK_OBJECT_BIN) {
+            begin = static_cast<size_t> (value.via.bin.ptr - data);
+            end = begin + value.via.bin.size;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool BatchDecoder::column_info(const FieldRef & column, Column & info) const {
+    size_t begin;
+    size_t end;
+    if(!column_range(column, begin, end) || begin >= end) {
+        return false;
+    }
+    uint8_t tag = GetBuffer()[begin];
+    info.kind = static_cast<size_t> (tag >> 4);
+    info.width = static_cast<size_t> (tag & 0x0F);
+    info.data = begin + 1;
+    info.end = end;
+    if((info.width != 1 && info.width != 2 && info.width != 4 && info.width != 8) || m_count > (end - info.data) / info.width) {
+        return false;
+    }
+    info.values = info.data + m_count * info.width;
+    switch(info.kind) {
+        case ColumnEncoded:
+            // The last end offset is the size of the values
+            return m_count && column_bits(info, m_count - 1) == end - info.values;
+        case ColumnUnsigned:
+        case ColumnSigned:
+            return info.values == end;
+        case ColumnFloat:
+            return (info.width == sizeof (float) || info.width == sizeof (double)) && info.values == end;
+        case ColumnBool:
+            return info.width == 1 && info.values == end;
+    }
+    return false;
+}
+
+bool BatchDecoder::column_encoded(const Column & info, size_t index, size_t & begin, size_t & end) const {
+    uint64_t first = index ? column_bits(info, index - 1) : 0;
+    uint64_t last = column_bits(info, index);
+    if(first > last || last > info.end - info.values) {
+        return false;
+    }
+    begin = info.values + static_cast<size_t> (first);
+    end = info.values + static_cast<size_t> (last);
+    return true;
+}
+
+/*
+ * Shortest encoding of a packed value, as made by msgpack_pack functions
+ */
+static size_t column_encode(size_t kind, size_t width, uint64_t bits, uint8_t *buffer) {
+    uint8_t type;
+    size_t size;
+    if(kind == BatchDecoder::ColumnBool) {
+        buffer[0] = bits ? 0xC3 : 0xC2;
+        return 1;
+    } else if(kind == BatchDecoder::ColumnFloat) {
+        type = width == sizeof (float) ? 0xCA : 0xCB;
+        size = width;
+    } else if(kind == BatchDecoder::ColumnSigned && static_cast<int64_t> (bits) < 0) {
+        int64_t value = static_cast<int64_t> (bits);
+        if(value >= -32) {
+            buffer[0] = static_cast<uint8_t> (bits);
+            return 1;
+        }
+        type = value >= INT8_MIN ? 0xD0 : (value >= INT16_MIN ? 0xD1 : (value >= INT32_MIN ? 0xD2 : 0xD3));
+        size = value >= INT8_MIN ? 1 : (value >= INT16_MIN ? 2 : (value >= INT32_MIN ? 4 : 8));
+    } else {
+        if(bits < 0x80) {
+            buffer[0] = static_cast<uint8_t> (bits);
+            return 1;
+        }
+        size = column_width(bits);
+        type = size == 1 ? 0xCC : (size == 2 ? 0xCD : (size == 4 ? 0xCE : 0xCF));
+    }
+    // Big-endian as in msgpack
+    buffer[0] = type;
+    for (size_t i = 0; i < size; i++) {
+        buffer[size - i] = static_cast<uint8_t> (bits >> (i * 8));
+    }
+    return size + 1;
+}
+
+bool BatchDecoder::ColumnValue(const FieldRef & column, size_t index, const uint8_t * & data, size_t & size, uint8_t *buffer) const {
+    Column info;
+    if(index >= m_count || !column_info(column, info)) {
+        return false;
+    }
+    if(info.kind == ColumnEncoded) {
+        size_t begin;
+        size_t end;
+        if(!column_encoded(info, index, begin, end) || begin == end) {
+            return false;
+        }
+        data = GetBuffer() + begin;
+        size = end - begin;
+        return true;
+    }
+    if(!buffer) {
+        return false;
+    }
+    size = column_encode(info.kind, info.width, column_bits(info, index), buffer);
+    data = buffer;
+    return true;
+}
+
+/*
+ *
+ */
+Index::Index(const Decoder & decoder, FieldRef *storage, size_t capacity) : m_decoder(decoder), m_fields(storage), m_count(0), m_indexed(true), m_valid(true) {
+    FieldRef field = FieldRef();
+    while(decoder.FieldNext(field)) {
+        if(m_indexed && m_fields && m_count < capacity) {
+            m_fields[m_count++] = field;
+        } else {
+            m_indexed = false;
+        }
+    }
+    if(!decoder.FieldEnd(field)) {
+        // Nothing is found in a corrupted record rather than a part of it
+        m_count = 0;
+        m_indexed = true;
+        m_valid = false;
+        return;
+    }
+    if(!m_indexed) {
+        m_count = 0;
+        return;
+    }
+    // The first field wins for duplicate keys, as in Decoder::FieldFind
+    std::sort(m_fields, m_fields + m_count, [](const FieldRef & a, const FieldRef & b) {
+        return a.id < b.id || (a.id == b.id && a.offset < b.offset);
+    });
+}
+
+FieldRef Index::Lookup(KeyType id) const {
+    if(!m_indexed) {
+        return m_decoder.Lookup(id);
+    }
+    const FieldRef *end = m_fields + m_count;
+    const FieldRef *pos = std::lower_bound(static_cast<const FieldRef *> (m_fields), end, id, [](const FieldRef & field, KeyType key) {
+        return field.id < key;
+    });
+    if(pos != end && pos->id == id) {
+        return *pos;
+    }
+    FieldRef field = FieldRef();
+    field.id = id;
+    return field;
+}
+
+/*
+ *
+ */
+BufferPool::BufferPool(uint8_t *memory, size_t size, size_t buffer_size) : m_buffer_size(0), m_count(0), m_local(nullptr), m_remote(nullptr) {
+    if(!memory || !buffer_size) {
+        return;
+    }
+    m_buffer_size = (buffer_size + CacheLine - 1) / CacheLine * CacheLine;
+    size_t pad = (CacheLine - reinterpret_cast<uintptr_t> (memory) % CacheLine) % CacheLine;
+    if(size <= pad) {
+        return;
+    }
+    m_count = (size - pad) / m_buffer_size;
+    // Buffers are taken in the address order
+    for (size_t i = m_count; i-- > 0;) {
+        Node *node = reinterpret_cast<Node *> (memory + pad + i * m_buffer_size);
+        node->next = m_local;
+        m_local = node;
+    }
+}
+
+BufferPool::Handle BufferPool::Acquire() {
+    if(!m_local) {
+        m_local = m_remote.exchange(nullptr, std::memory_order_acquire);
+        if(!m_local) {
+            return Handle();
+        }
+    }
+    Node *node = m_local;
+    m_local = node->next;
+    return Handle(this, reinterpret_cast<uint8_t *> (node), m_buffer_size);
+}
+
+void BufferPool::Release(uint8_t *buffer) {
+    if(!buffer) {
+        return;
+    }
+    Node *node = reinterpret_cast<Node *> (buffer);
+    node->next = m_remote.load(std::memory_order_relaxed);
+    while(!m_remote.compare_exchange_weak(node->next, node, std::memory_order_release, std::memory_order_relaxed)) {
+    }
+}
+
+BufferPool::Handle::Handle() : Encoder(), m_pool(nullptr) {
+}
+
+BufferPool::Handle::Handle(BufferPool *pool, uint8_t *data, size_t size) : Encoder(data, size), m_pool(pool) {
+}
+
+BufferPool::Handle::Handle(Handle && other) : Encoder(other), m_pool(other.m_pool) {
+    other.m_pool = nullptr;
+    other.AssignBuffer(nullptr, 0);
+}
+
+BufferPool::Handle & BufferPool::Handle::operator=(Handle && other) {
+    if(this != &other) {
+        Release();
+        Encoder::operator=(other);
+        m_pool = other.m_pool;
+        other.m_pool = nullptr;
+        other.AssignBuffer(nullptr, 0);
+    }
+    return *this;
+}
+
+BufferPool::Handle::~Handle() {
+    Release();
+}
+
+void BufferPool::Handle::Release() {
+    if(m_pool) {
+        m_pool->Release(GetBuffer());
+        m_pool = nullptr;
+        AssignBuffer(nullptr, 0);
+    }
+}
+
+/*
+ * Shortest decimal digits of floating point numbers (Grisu2 by Florian Loitsch) without the locale.
+ * The digits always restore the same value and are the shortest for almost all values.
+ */
+/*
+ * Normalized positive value and the boundaries of its rounding interval with the same exponent
+ */
+template < typename T, typename Bits>
+static void grisu_boundaries(T value, DiyFp & v, DiyFp & minus, DiyFp & plus) {
+    const int precision = std::numeric_limits<T>::digits; // with the hidden bit
+    const int bias = std::numeric_limits<T>::max_exponent - 1 + (precision - 1);
+    const uint64_t hidden = static_cast<uint64_t> (1) << (precision - 1);
+    Bits bits;
+    memcpy(&bits, &value, sizeof (bits));
+    uint64_t fraction = bits & (hidden - 1);
+    int exponent = static_cast<int> (bits >> (precision - 1));
+    DiyFp w = exponent ? DiyFp{fraction + hidden, exponent - bias} : DiyFp{fraction, 1 - bias};
+    // The lower boundary is closer at powers of two
+    bool closer = !fraction && exponent > 1;
+    plus = diyfp_normalize({2 * w.f + 1, w.e - 1});
+    minus = closer ? DiyFp{4 * w.f - 1, w.e - 2} : DiyFp{2 * w.f - 1, w.e - 1};
+    minus.f <<= minus.e - plus.e;
+    minus.e = plus.e;
+    v = diyfp_normalize(w);
+}
+
+static inline void grisu_round(char *buffer, int length, uint64_t dist, uint64_t delta, uint64_t rest, uint64_t ten) {
+    while(rest < dist && delta - rest >= ten && (rest + ten < dist || dist - rest > rest + ten - dist)) {
+        buffer[length - 1]--;
+        rest += ten;
+    }
+}
+
+static int grisu_digits(char *buffer, int & exponent, const DiyFp & minus, const DiyFp & w, const DiyFp & plus) {
+    uint64_t delta = plus.f - minus.f;
+    uint64_t dist = plus.f - w.f;
+    const int shift = -plus.e;
+    const uint64_t one = static_cast<uint64_t> (1) << shift;
+    uint32_t integral = static_cast<uint32_t> (plus.f >> shift);
+    uint64_t fractional = plus.f & (one - 1);
+
+    uint32_t pow10 = 1;
+    int n = 1;
+    while(integral / pow10 >= 10) {
+        pow10 *= 10;
+        n++;
+    }
+    int length = 0;
+    while(n > 0) {
+        uint32_t digit = integral / pow10;
+        buffer[length++] = static_cast<char> ('0' + digit);
+        integral -= digit * pow10;
+        n--;
+        uint64_t rest = (static_cast<uint64_t> (integral) << shift) + fractional;
+        if(rest <= delta) {
+            exponent += n;
+            grisu_round(buffer, length, dist, delta, rest, static_cast<uint64_t> (pow10) << shift);
+            return length;
+        }
+        pow10 /= 10;
+    }
+    for (;;) {
+        fractional *= 10;
+        buffer[length++] = static_cast<char> ('0' + (fractional >> shift));
+        fractional &= one - 1;
+        delta *= 10;
+        dist *= 10;
+        exponent--;
+        if(fractional <= delta) {
+            break;
+        }
+    }
+    grisu_round(buffer, length, dist, delta, fractional, one);
+    return length;
+}
+
+/*
+ * Digits of a positive finite value, which is digits * 10^exponent
+ * @return Number of digits, up to 17
+ */
+template < typename T, typename Bits>
+static int grisu2(T value, char *buffer, int & exponent) {
+    DiyFp v;
+    DiyFp minus;
+    DiyFp plus;
+    grisu_boundaries<T, Bits>(value, v, minus, plus);
+
+    // Cached power to get the exponent of the product in [-60, -32]
+    const int alpha = -60;
+    int f = alpha - plus.e - 1;
+    int k = (f * 78913) / (1 << 18) + static_cast<int> (f > 0);
+    const CachedPower & cached = grisu_powers[static_cast<size_t> ((k - grisu_powers[0].k + 7) / 8)];
+    DiyFp c = {cached.f, cached.e};
+
+    DiyFp w = diyfp_mul(v, c);
+    DiyFp w_minus = diyfp_mul(minus, c);
+    DiyFp w_plus = diyfp_mul(plus, c);
+    exponent = -cached.k;
+    return grisu_digits(buffer, exponent, {w_minus.f + 1, w_minus.e}, w, {w_plus.f - 1, w_plus.e});
+}
+
+/*
+ *
+ */
+JsonWriter::JsonWriter(char *buffer, size_t size, Sink sink, void *context) :
+m_data(buffer), m_size(buffer ? size : 0), m_used(0), m_sink(sink), m_context(context) {
+}
+
+bool JsonWriter::Flush() {
+    if(!m_sink || (m_used && !m_sink(m_context, m_data, m_used))) {
+        return false;
+    }
+    m_used = 0;
+    return true;
+}
+
+bool JsonWriter::Write(const Decoder & record) {
+    size_t temp = m_used;
+    if(write_record(record)) {
+        return true;
+    }
+    if(!m_sink) {
+        m_used = temp;
+    }
+    return false;
+}
+
+/*
+ * Key of the next field, a positive integer as checked by Decoder::check_key_type
+ */
+static bool json_key(const char *data, size_t size, size_t & offset, KeyType & id) {
+    uint8_t type = static_cast<uint8_t> (data[offset]);
+    if(type && type < 0x80) {
+        // Positive fixnum
+        id = type;
+        offset++;
+        return true;
+    }
+
+    msgpack_unpacked msg;
+    msgpack_unpacked_init(&msg);
+
+    size_t temp = offset;
+    if(msgpack_unpack_next(&msg, data, size, &temp) <= 0) {
+        return false;
+    }
+
+    assert(msg.zone == nullptr);
+
+    if(msg.data.type != MSGPACK_OBJECT_POSITIVE_INTEGER || !msg.data.via.u64 || msg.data.via.u64 > static_cast<KeyType> (-1)) {
+        return false;
+    }
+    id = static_cast<KeyType> (msg.data.via.u64);
+    offset = temp;
+    return true;
+}
+
+bool JsonWriter::write_record(const Decoder & record) {
+    const char *data = reinterpret_cast<const char *> (record.GetBuffer());
+    size_t size = record.GetSize();
+    FieldRef field = FieldRef();
+    size_t offset = 0;
+    KeyType id;
+    if(!put('{')) {
+        return false;
+    }
+    // Keys and values are decoded once, Decoder::FieldNext would decode each value twice
+    while(offset < size && json_key(data, size, offset, id)) {
+        if(field && !put(',')) {
+            return false;
+        }
+        field.id = id;
+        field.offset = offset;
+        if(!put('"') || !put_unsigned(id) || !put("\":", 2) || !put_value(data, size, offset, false)) {
+            return false;
+        }
+        field.size = offset - field.offset;
+    }
+    // A decode error must not look like the end of the record
+    return record.FieldEnd(field) && put('}');
+}
+
+bool JsonWriter::put_chunks(const char *data, size_t size) {
+    while(size) {
+        if(m_used >= m_size && !Flush()) {
+            return false;
+        }
+        size_t len = std::min(size, m_size - m_used);
+        memcpy(&m_data[m_used], data, len);
+        m_used += len;
+        data += len;
+        size -= len;
+    }
+    return true;
+}
+
+bool JsonWriter::put_unsigned(uint64_t value) {
+    char text[20];
+    size_t pos = sizeof (text);
+    do {
+        text[--pos] = static_cast<char> ('0' + value % 10);
+        value /= 10;
+    } while(value);
+    return put(&text[pos], sizeof (text) - pos);
+}
+
+bool JsonWriter::put_signed(int64_t value) {
+    if(value < 0) {
+        // Negation in unsigned type is valid for the minimal value too
+        return put('-') && put_unsigned(0 - static_cast<uint64_t> (value));
+    }
+    return put_unsigned(static_cast<uint64_t> (value));
+}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wfloat-equal" // exact comparison is intended here
+
+bool JsonWriter::put_double(double value, bool single) {
+    if(!std::isfinite(value)) {
+        return put("null", 4);
+    }
+    char text[32];
+    size_t len = 0;
+    if(std::signbit(value)) {
+        text[len++] = '-';
+        value = -value;
+    }
+    // Integer values are written with ".0" to be read back as floating point
+    if(value < (single ? 16777216.0 : 1e15) && value == static_cast<double> (static_cast<uint64_t> (value))) {
+        return put(text, len) && put_unsigned(static_cast<uint64_t> (value)) && put(".0", 2);
+    }
+
+    char digits[20];
+    int exponent;
+    int count = single ? grisu2<float, uint32_t>(static_cast<float> (value), digits, exponent) :
+            grisu2<double, uint64_t>(value, digits, exponent);
+    size_t size = static_cast<size_t> (count);
+
+    // Position of the decimal point from the first digit
+    int point = count + exponent;
+    if(point > 0 && point <= 15) {
+        size_t whole = static_cast<size_t> (point);
+        if(size <= whole) {
+            // digits000.0
+            memcpy(&text[len], digits, size);
+            memset(&text[len + size], '0', whole - size);
+            len += whole;
+            text[len++] = '.';
+            text[len++] = '0';
+        } else {
+            // dig.its
+            memcpy(&text[len], digits, whole);
+            len += whole;
+            text[len++] = '.';
+            memcpy(&text[len], &digits[whole], size - whole);
+            len += size - whole;
+        }
+    } else if(point <= 0 && point > -4) {
+        // 0.000digits
+        size_t zeros = static_cast<size_t> (-point);
+        text[len++] = '0';
+        text[len++] = '.';
+        memset(&text[len], '0', zeros);
+        len += zeros;
+        memcpy(&text[len], digits, size);
+        len += size;
+    } else {
+        // d.igitse-123
+        text[len++] = digits[0];
+        if(size > 1) {
+            text[len++] = '.';
+            memcpy(&text[len], &digits[1], size - 1);
+            len += size - 1;
+        }
+        text[len++] = 'e';
+        int power = point - 1;
+        if(power < 0) {
+            text[len++] = '-';
+            power = -power;
+        }
+        if(power >= 100) {
+            text[len++] = static_cast<char> ('0' + power / 100);
+        }
+        if(power >= 10) {
+            text[len++] = static_cast<char> ('0' + power / 10 % 10);
+        }
+        text[len++] = static_cast<char> ('0' + power % 10);
+    }
+    return put(text, len);
+}
+
+#pragma GCC diagnostic pop
+
+bool JsonWriter::put_string(const char *data, size_t size) {
+    static const char hex[] = "0123456789abcdef";
+    if(!put('"')) {
+        return false;
+    }
+    const char *start = data;
+    const char *end = data + size;
+    for (const char *p = data; p < end; p++) {
+        unsigned char value = static_cast<unsigned char> (*p);
+        if(value >= 0x20 && value != '"' && value != '\\') {
+            continue;
+        }
+        // Flush the run of plain chars and write the escape sequence
+        if(!put(start, static_cast<size_t> (p - start))) {
+            return false;
+        }
+        start = p + 1;
+        char escape[6] = {'\\', 'u', '0', '0', hex[value >> 4], hex[value & 0xF]};
+        if(value == '"' || value == '\\') {
+            escape[1] = static_cast<char> (value);
+            if(!put(escape, 2)) {
+                return false;
+            }
+        } else if(value == '\n' || value == '\r' || value == '\t') {
+            escape[1] = value == '\n' ? 'n' : (value == '\r' ? 'r' : 't');
+            if(!put(escape, 2)) {
+                return false;
+            }
+        } else if(!put(escape, sizeof (escape))) {
+            return false;
+        }
+    }
+    return put(start, static_cast<size_t> (end - start)) && put('"');
+}
+
+bool JsonWriter::put_base64(const uint8_t *data, size_t size) {
+    char text[4];
+    for (size_t i = 0; i < size; i += 3) {
+        size_t count = std::min(static_cast<size_t> (3), size - i);
+        uint32_t bits = static_cast<uint32_t> (data[i]) << 16;
+        if(count > 1) {
+            bits |= static_cast<uint32_t> (data[i + 1]) << 8;
+        }
+        if(count > 2) {
+            bits |= data[i + 2];
+        }
+        text[0] = base64_chars[(bits >> 18) & 0x3F];
+        text[1] = base64_chars[(bits >> 12) & 0x3F];
+        text[2] = count > 1 ? base64_chars[(bits >> 6) & 0x3F] : '=';
+        text[3] = count > 2 ? base64_chars[bits & 0x3F] : '=';
+        if(!put(text, sizeof (text))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Size of the data after the type byte for fixed size numbers from float32 (0xCA) to int64 (0xD3)
+ */
+static const uint8_t json_number_size[] = {4, 8, 1, 2, 4, 8, 1, 2, 4, 8};
+
+bool JsonWriter::put_value(const char *data, size_t size, size_t & offset, bool nested) {
+    // Numbers and bool are decoded without msgpack_unpack_next
+    uint8_t type = offset < size ? static_cast<uint8_t> (data[offset]) : 0xC1;
+    if(type < 0x80) {
+        offset++;
+        return put_unsigned(type);
+    } else if(type >= 0xE0) {
+        offset++;
+        return put_signed(static_cast<int8_t> (type));
+    } else if(type == 0xC2 || type == 0xC3) {
+        offset++;
+        return type == 0xC3 ? put("true", 4) : put("false", 5);
+    } else if(type >= 0xCA && type <= 0xD3) {
+        size_t len = json_number_size[type - 0xCA];
+        if(size - offset <= len) {
+            return false;
+        }
+        uint64_t bits = 0;
+        for (size_t i = 1; i <= len; i++) {
+            bits = (bits << 8) | static_cast<uint8_t> (data[offset + i]);
+        }
+        offset += len + 1;
+        if(type == 0xCA) {
+            uint32_t single_bits = static_cast<uint32_t> (bits);
+            float single;
+            memcpy(&single, &single_bits, sizeof (single));
+            return put_double(single, true);
+        } else if(type == 0xCB) {
+            double wide;
+            memcpy(&wide, &bits, sizeof (wide));
+            return put_double(wide, false);
+        } else if(type <= 0xCF) {
+            return put_unsigned(bits);
+        } else if(type == 0xD0) {
+            return put_signed(static_cast<int8_t> (bits));
+        } else if(type == 0xD1) {
+            return put_signed(static_cast<int16_t> (bits));
+        } else if(type == 0xD2) {
+            return put_signed(static_cast<int32_t> (bits));
+        }
+        return put_signed(static_cast<int64_t> (bits));
+    }
+
+    msgpack_unpacked msg;
+    msgpack_unpacked_init(&msg);
+
+    if(msgpack_unpack_next(&msg, data, size, &offset) <= 0) {
+        return false;
+    }
+
+    assert(msg.zone == nullptr);
+
+    msgpack_object value = msg.data;
+    if(value.type == MSGPACK_OBJECT_POSITIVE_INTEGER) {
+        return put_unsigned(value.via.u64);
+    } else if(value.type == MSGPACK_OBJECT_NEGATIVE_INTEGER) {
+        return put_signed(value.via.i64);
+    } else if(value.type == MSGPACK_OBJECT_BOOLEAN) {
+        return value.via.boolean ? put("true", 4) : put("false", 5);
+    } else if(value.type == MSGPACK_OBJECT_FLOAT32) {
+        return put_double(value.via.f64, true);
+    } else if(value.type == MSGPACK_OBJECT_FLOAT || value.type == MSGPACK_OBJECT_FLOAT64) {
+        return put_double(value.via.f64, false);
+    } else if(value.type == MSGPACK_OBJECT_NIL) {
+        return put("null", 4);
+    } else if(nested) {
+        // Array elements are numbers only
+        return false;
+    } else if(value.type == MSGPACK_OBJECT_STR) {
+        size_t len = value.via.str.size;
+        if(len && value.via.str.ptr[len - 1] == '\0') {
+            len--;
+        }
+        return put_string(value.via.str.ptr, len);
+    } else if(value.type == MSGPACK_OBJECT_BIN) {
+        return put("{\"base64\":\"", 11) && put_base64(reinterpret_cast<const uint8_t *> (value.via.bin.ptr), value.via.bin.size) && put("\"}", 2);
+    } else if(value.type == MSGPACK_OBJECT_ARRAY) {
+        size_t count = value.via.array.size;
+        if(!put('[')) {
+            return false;
+        }
+        for (size_t i = 0; i < count; i++) {
+            if((i && !put(',')) || !put_value(data, size, offset, true)) {
+                return false;
+            }
+        }
+        return put(']');
+    }
+    return false;
 }
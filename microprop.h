@@ -6,6 +6,12 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <algorithm>
+#include <atomic>
+#include <utility>
+
+#if __cplusplus >= 201402L
+#include <array>
+#endif
 
 #include <msgpack.h>
 
@@ -17,6 +23,10 @@
 #define SCOPE(scope) scope
 #endif
 
+#ifndef MICROPROP_GROUP_DEPTH
+#define MICROPROP_GROUP_DEPTH 4 ///< Maximum nesting of open groups in Encoder
+#endif
+
 /*
  * Brief description of the data storage format.
  * 
@@ -26,6 +36,7 @@
  * For use property of type array, after the field key stored type array and data of the array elements.
  * Supported numeric arrays only.
  * The ID of the next field is located immediately after the last element of the array, also without using the MAP type.
+ * Nested group of fields is stored as a blob (bin 32) with the fields inside, so it is skipped by its size.
  * 
  * Used fork msgpack for C/C++ https://github.com/msgpack/msgpack-c library,
  * where dynamic memory allocation was removed when packing and unpacking data from/to fixed static buffer.
@@ -35,6 +46,9 @@ namespace microprop {
 
 typedef unsigned int KeyType; ///< Only numbers are used as field identifiers
 
+class Decoder;
+class BatchDecoder;
+
 class Encoder {
 public:
 
@@ -42,6 +56,10 @@ public:
 
     Encoder(uint8_t *data, size_t size);
 
+    Encoder(const Encoder & other);
+
+    Encoder & operator=(const Encoder & other);
+
     virtual ~Encoder();
 
     bool AssignBuffer(uint8_t *data, size_t size);
@@ -58,6 +76,21 @@ public:
         return m_data;
     }
 
+    /**
+     * Write float and double values (and array elements) in the narrowest lossless form:
+     * integer, float32 or float64. Decoder::Read into float or double returns the same value for any of these,
+     * integers are rounded to float as float64 values are. Reading integral values into an integer type
+     * is checked for overflow, as for other integers, so such reads into a narrower type fail instead of truncating.
+     * @param enable Compact mode flag, disabled by default
+     */
+    inline void SetCompactFloat(bool enable) {
+        m_compact_float = enable;
+    }
+
+    inline bool GetCompactFloat() {
+        return m_compact_float;
+    }
+
     template < typename T>
     typename std::enable_if<std::is_arithmetic<T>::value, bool>::type
     inline Write(KeyType id, T value) {
@@ -89,6 +122,109 @@ public:
 
     bool WriteAsString(KeyType id, const char *str);
 
+    /**
+     * Start a group field, the following fields are written into the group until EndGroup.
+     * The group is stored as a blob with a fixed size header, which is filled in by EndGroup,
+     * so nested fields are written in place and the group is skipped as one field when reading.
+     * @param id Field identifier
+     * @return Returns true if the group is started
+     */
+    bool BeginGroup(KeyType id);
+
+    /**
+     * Finish the last started group
+     * @return Returns true if the group was open
+     */
+    bool EndGroup();
+
+    inline size_t GetGroupDepth() {
+        return m_group_depth;
+    }
+
+    /**
+     * Write a field with an already encoded value, as returned by Decoder::FieldValue
+     * @param id Field identifier
+     * @param data Encoded value bytes (including the array elements)
+     * @param size Size of the encoded value
+     * @return Returns true if the field is written
+     */
+    bool WriteRaw(KeyType id, const uint8_t *data, size_t size);
+
+    /**
+     * Write a patch with the changed, added and removed fields of the current record relative to the base one.
+     * Changed and added fields are stored with their current values, removed fields are stored with a nil value.
+     * For records with the same field order the diff takes linear time.
+     * @param base Previous record
+     * @param current Current record
+     * @return Returns true if the patch is written, on error (including a decode error in the records)
+     * the buffer is not changed
+     */
+    bool WriteDiff(Decoder & base, Decoder & current);
+
+    /**
+     * Write the current record restored from the base record and the patch made by WriteDiff in one pass.
+     * Fields stay in the base order, added fields are placed at the end.
+     * @param base Previous record
+     * @param patch Patch for this base record
+     * @return Returns true if the record is written, on error (including a decode error in the records)
+     * the buffer is not changed
+     */
+    bool WritePatch(Decoder & base, Decoder & patch);
+
+    /**
+     * Merge the fields of several records, the field from the last record wins.
+     * Each record is passed once and the encoded values are copied without decoding.
+     * The fields of the last record are written first, then the remaining fields of the previous ones.
+     * @param layers Records in the ascending priority order
+     * @param count Number of records
+     * @param seen Buffer for the set of written keys, must be larger than the number of unique keys
+     * @param seen_size Size of the set buffer in elements
+     * @return Returns true if all fields are written, on error (including a decode error in a layer)
+     * the buffer is not changed
+     */
+    bool Merge(Decoder * layers[], size_t count, KeyType *seen, size_t seen_size);
+
+    template <size_t N, typename ... Types>
+    inline bool Merge(KeyType(&seen)[N], Types & ... layers) {
+        Decoder * list[] = {&layers...};
+        return Merge(list, sizeof...(layers), seen, N);
+    }
+
+    /**
+     * Write fields from JSON object {"id": value, ...} as made by JsonWriter without memory allocation.
+     * Integer and floating point numbers, true and false, strings, arrays of numbers and blobs as {"base64": "..."}
+     * are supported, fields with null value are skipped, null in numeric arrays is read as NaN.
+     * Numbers are parsed independently of the locale and rounded correctly.
+     * @param json JSON text
+     * @param size Size of the text
+     * @param parsed Receives the size of the parsed object, to read the next one from a stream
+     * @return Returns true if the object is written, on error the buffer is not changed
+     */
+    bool WriteJson(const char *json, size_t size, size_t *parsed = nullptr);
+
+    /**
+     * Write records with the same set of keys as a columnar block for BatchDecoder.
+     * The block stores the number of records, and then for each key of the first record
+     * the key and a blob with the values of all records (the column).
+     * Columns of integers, float32, float64 or bool values are packed with a fixed width,
+     * other columns store the encoded values with a table of their offsets.
+     * For records with the same field order it takes linear time.
+     * @param records Records to write
+     * @param count Number of records
+     * @return Returns true if the block is written, on error (including a decode error in the records)
+     * the buffer is not changed
+     */
+    bool WriteBatch(Decoder * records[], size_t count);
+
+    /**
+     * Write the record with the specified index from the columnar block, in time independent of the index.
+     * Packed integers are restored in the shortest encoding.
+     * @param batch Columnar block
+     * @param index Record index
+     * @return Returns true if the record is written, on error the buffer is not changed
+     */
+    bool WriteRecord(const BatchDecoder & batch, size_t index);
+
     SCOPE(protected) :
 
 
@@ -134,8 +270,14 @@ public:
         } else if (std::is_same<unsigned long long, T>::value) {
             return msgpack_pack_unsigned_long_long(&m_pk, value) == 0;
         } else if (std::is_same<float, T>::value) {
+            if (m_compact_float) {
+                return msgpack_write_compact(static_cast<double> (value));
+            }
             return msgpack_pack_float(&m_pk, value) == 0;
         } else if (std::is_same<double, T>::value) {
+            if (m_compact_float) {
+                return msgpack_write_compact(static_cast<double> (value));
+            }
             return msgpack_pack_double(&m_pk, value) == 0;
         } else if (std::is_same<bool, T>::value) {
             if (value) {
@@ -147,6 +289,13 @@ public:
         return false;
     }
 
+    bool msgpack_write_compact(double value);
+    bool column_write(uint64_t bits, size_t width);
+
+    bool write_json(const char * & json, const char *end);
+    bool write_json_value(KeyType id, const char * & json, const char *end);
+    bool write_json_scalar(const char * & json, const char *end);
+
     SCOPE(protected) :
 
     static int msgpack_callback(void* data, const char* buf, size_t len, void* callback_param);
@@ -157,6 +306,9 @@ public:
     size_t m_size;
     size_t m_used;
     msgpack_packer m_pk;
+    bool m_compact_float;
+    size_t m_group[MICROPROP_GROUP_DEPTH]; ///< Offsets of the open group headers
+    size_t m_group_depth;
 
 };
 
@@ -165,6 +317,54 @@ public:
  * 
  */
 
+/**
+ * Bump allocator over a caller buffer for reading fields of unknown size.
+ * Memory is released all at once with Reset.
+ * Any class with the same Allocate method can be used for reading instead.
+ */
+class Arena {
+public:
+
+    Arena(uint8_t *data, size_t size);
+
+    /**
+     * @param size Size of the memory block
+     * @param align Alignment of the memory block, power of two
+     * @return Pointer to the memory block or nullptr if there is not enough space
+     */
+    void * Allocate(size_t size, size_t align);
+
+    inline void Reset() {
+        m_used = 0;
+    }
+
+    inline size_t GetUsed() const {
+        return m_used;
+    }
+
+    inline size_t GetFree() const {
+        return m_size - m_used;
+    }
+
+    SCOPE(private) :
+    uint8_t *m_data;
+    size_t m_size;
+    size_t m_used;
+};
+
+/**
+ * Field position in the buffer, the result of the lookup without the inner pointer of Decoder
+ */
+struct FieldRef {
+    KeyType id;
+    size_t offset; ///< Offset of the encoded value, zero if the field is not found
+    size_t size; ///< Size of the encoded value including the array elements
+
+    inline explicit operator bool() const {
+        return offset != 0;
+    }
+};
+
 class Decoder {
 public:
 
@@ -182,7 +382,7 @@ public:
         m_offset = 0;
     }
 
-    inline size_t GetSize() {
+    inline size_t GetSize() const {
         return m_size;
     }
 
@@ -192,14 +392,19 @@ public:
         }
     }
 
-    inline const uint8_t * GetBuffer() {
-        return const_cast<uint8_t *> (reinterpret_cast<const uint8_t *> (m_data));
+    inline const uint8_t * GetBuffer() const {
+        return reinterpret_cast<const uint8_t *> (m_data);
     }
 
     template < typename T>
     typename std::enable_if<std::is_arithmetic<T>::value, bool>::type
     inline Read(KeyType id, T & value) {
-        return FieldFind(id) && msgpack_read(value);
+        if (!FieldFind(id)) {
+            return false;
+        }
+        // The inner pointer stays at the field data, as for arrays and blobs
+        size_t offset = m_offset;
+        return msgpack_read(offset, value);
     }
 
     /**
@@ -212,43 +417,148 @@ public:
 
     /**
      * Skip to the field data and read ID next field
-     * @return Returns true, if the next field present, or false on error data or end buffer.
+     * @return Returns true, if the next field present, or false on error data or end buffer (see FieldEnd).
      */
     bool FieldNext(KeyType & id);
 
+    /**
+     * Search for the field after the current one, continuing from the beginning of the buffer at the end.
+     * Sequential search of fields in the stored order takes linear time in total.
+     * @param id Field identifier
+     * @return Returns true if the field with the specified ID found
+     */
+    bool FieldSeek(KeyType id);
+
+    /**
+     * Get the encoded value of the current field (after FieldFind, FieldNext or FieldSeek) without moving the inner pointer
+     * @param data Pointer to the encoded value in the buffer
+     * @param size Size of the encoded value including the array elements
+     * @return Returns true if the current field is valid
+     */
+    bool FieldValue(const uint8_t * & data, size_t & size);
+
     template < typename T>
     typename std::enable_if<(std::is_array<T>::value && std::is_arithmetic<typename std::remove_extent<T>::type>::value) ||
     (std::is_reference<T>::value && std::is_arithmetic<typename std::remove_reference<T>::type>::value), size_t>::type
     inline Read(KeyType id, T & value) {
-        if (FieldFind(id)) {
-            msgpack_unpacked msg;
-            msgpack_unpacked_init(&msg);
+        return FieldFind(id) ? read_array(m_offset, value) : 0;
+    }
 
-            if (msgpack_unpack_next(&msg, const_cast<const char*> (m_data), m_size, &m_offset) >= 0) {
+    size_t Read(KeyType id, uint8_t *data, size_t size);
 
-                assert(msg.zone == nullptr);
+    /**
+     * Read a numeric array or a blob (for uint8_t only) of any size into memory from the allocator, in one pass
+     * @param id Field identifier
+     * @param value Receives pointer to the allocated elements
+     * @param alloc Arena or other allocator with method void * Allocate(size_t size, size_t align)
+     * @return Number of elements, 0 if the field is not found or empty, or there is not enough memory
+     */
+    template < typename T, typename Allocator>
+    typename std::enable_if<std::is_arithmetic<T>::value && !std::is_arithmetic<Allocator>::value, size_t>::type
+    inline Read(KeyType id, T * & value, Allocator & alloc) {
+        return FieldFind(id) ? read_alloc(m_offset, value, alloc) : 0;
+    }
 
-                msgpack_object array = msg.data;
-                if (array.type == MSGPACK_OBJECT_ARRAY) {
-                    size_t count = array.via.array.size;
-                    if (std::extent<T>::value < count) {
-                        return 0;
-                    }
-                    for (size_t i = 0; i < count; i++) {
-                        if (!msgpack_read(value[i])) {
-                            return 0;
-                        }
-                    }
-                    return count;
-                }
-            }
-        }
-        return 0;
+    const char * ReadAsString(KeyType id, size_t *length = nullptr);
+
+    /*
+     * Stateless access without the inner pointer. These methods do not change the object,
+     * so one decoder can be shared between threads for reading.
+     */
+
+    /**
+     * Search for the field from the beginning of the buffer
+     * @param id Field identifier
+     * @return Field position, false if the field is not found
+     */
+    FieldRef Lookup(KeyType id) const;
+
+    /**
+     * Move to the next field, starting with an empty FieldRef for the first one
+     * @param field Current field, receives the next one, it is not changed on false
+     * @return Returns true, if the next field present, or false on error data or end buffer (see FieldEnd).
+     */
+    bool FieldNext(FieldRef & field) const;
+
+    /**
+     * Check that FieldNext returned false at the end of the data and not on a decode error
+     * @param field The last field returned by FieldNext, or an empty FieldRef if there was none
+     * @return Returns true if the field is followed by the end of the buffer or by padding:
+     * zero bytes or the cleared flash memory (0xFF bytes), the same as FieldFind stops at
+     */
+    bool FieldEnd(const FieldRef & field) const;
+
+    /**
+     * The same check after FieldNext(KeyType &) returned false
+     * @return Returns true if the iteration stopped at the end of the data and not on a decode error
+     */
+    bool FieldEnd() const;
+
+    template < typename T>
+    typename std::enable_if<std::is_arithmetic<T>::value, bool>::type
+    inline Get(const FieldRef & field, T & value) const {
+        size_t offset = field.offset;
+        return field && msgpack_read(offset, value);
     }
 
-    size_t Read(KeyType id, uint8_t *data, size_t size);
+    template < typename T>
+    typename std::enable_if<(std::is_array<T>::value && std::is_arithmetic<typename std::remove_extent<T>::type>::value) ||
+    (std::is_reference<T>::value && std::is_arithmetic<typename std::remove_reference<T>::type>::value), size_t>::type
+    inline Get(const FieldRef & field, T & value) const {
+        return field ? read_array(field.offset, value) : 0;
+    }
 
-    const char * ReadAsString(KeyType id, size_t *length = nullptr);
+    inline size_t Get(const FieldRef & field, uint8_t *data, size_t size) const {
+        return field ? read_blob(field.offset, data, size) : 0;
+    }
+
+    inline const char * GetAsString(const FieldRef & field, size_t *length = nullptr) const {
+        return read_string(field ? field.offset : 0, length);
+    }
+
+    template < typename T, typename Allocator>
+    typename std::enable_if<std::is_arithmetic<T>::value && !std::is_arithmetic<Allocator>::value, size_t>::type
+    inline Get(const FieldRef & field, T * & value, Allocator & alloc) const {
+        return field ? read_alloc(field.offset, value, alloc) : 0;
+    }
+
+    template < typename T>
+    typename std::enable_if<std::is_arithmetic<T>::value, bool>::type
+    inline Get(KeyType id, T & value) const {
+        return Get(Lookup(id), value);
+    }
+
+    template < typename T>
+    typename std::enable_if<(std::is_array<T>::value && std::is_arithmetic<typename std::remove_extent<T>::type>::value) ||
+    (std::is_reference<T>::value && std::is_arithmetic<typename std::remove_reference<T>::type>::value), size_t>::type
+    inline Get(KeyType id, T & value) const {
+        return Get(Lookup(id), value);
+    }
+
+    inline size_t Get(KeyType id, uint8_t *data, size_t size) const {
+        return Get(Lookup(id), data, size);
+    }
+
+    inline const char * GetAsString(KeyType id, size_t *length = nullptr) const {
+        return GetAsString(Lookup(id), length);
+    }
+
+    template < typename T, typename Allocator>
+    typename std::enable_if<std::is_arithmetic<T>::value && !std::is_arithmetic<Allocator>::value, size_t>::type
+    inline Get(KeyType id, T * & value, Allocator & alloc) const {
+        return Get(Lookup(id), value, alloc);
+    }
+
+    /**
+     * Get the fields of a group (or of a record stored in a blob) without copying
+     * @param field Group field
+     * @return Decoder for the group data, empty if the field is not a group
+     */
+    Decoder OpenGroup(const FieldRef & field) const;
+
+    inline Decoder OpenGroup(KeyType id) const {
+        return OpenGroup(Lookup(id));
+    }
 
     /*
      * To use inner classes when customizing derived objects.
@@ -257,24 +567,31 @@ public:
 
     template < typename T>
     typename std::enable_if<std::is_arithmetic<T>::value, bool>::type
-    msgpack_read(T & id) {
+    inline msgpack_read(T & id) {
+        return msgpack_read(m_offset, id);
+    }
+
+    template < typename T>
+    typename std::enable_if<std::is_arithmetic<T>::value, bool>::type
+    msgpack_read(size_t & offset, T & id) const {
         msgpack_unpacked msg;
         msgpack_unpacked_init(&msg);
 
-        if (msgpack_unpack_next(&msg, static_cast<const char *> (m_data), m_size, &m_offset) >= 0) {
+        if (msgpack_unpack_next(&msg, static_cast<const char *> (m_data), m_size, &offset) >= 0) {
 
             assert(msg.zone == nullptr);
 
             msgpack_object value = msg.data;
             if (value.type == MSGPACK_OBJECT_POSITIVE_INTEGER) {
                 T temp = static_cast<T> (value.via.u64);
-                if (static_cast<uint64_t> (temp) == value.via.u64) { // check overflow
+                // check overflow, floating point types are rounded as on reading float64
+                if (std::is_floating_point<T>::value || static_cast<uint64_t> (temp) == value.via.u64) {
                     id = temp;
                     return true;
                 }
             } else if (value.type == MSGPACK_OBJECT_NEGATIVE_INTEGER) {
                 T temp = static_cast<T> (value.via.i64);
-                if (static_cast<int64_t> (temp) == value.via.i64) { // check overflow
+                if (std::is_floating_point<T>::value || static_cast<int64_t> (temp) == value.via.i64) { // check overflow
                     id = temp;
                     return true;
                 }
@@ -290,7 +607,81 @@ public:
         return false;
     }
 
-    inline bool check_key_type(char value) {
+    template < typename T>
+    size_t read_array(size_t offset, T & value) const {
+        msgpack_unpacked msg;
+        msgpack_unpacked_init(&msg);
+
+        if (msgpack_unpack_next(&msg, static_cast<const char *> (m_data), m_size, &offset) >= 0) {
+
+            assert(msg.zone == nullptr);
+
+            msgpack_object array = msg.data;
+            if (array.type == MSGPACK_OBJECT_ARRAY) {
+                size_t count = array.via.array.size;
+                if (std::extent<T>::value < count) {
+                    return 0;
+                }
+                for (size_t i = 0; i < count; i++) {
+                    if (!msgpack_read(offset, value[i])) {
+                        return 0;
+                    }
+                }
+                return count;
+            }
+        }
+        return 0;
+    }
+
+    template < typename T, typename Allocator>
+    size_t read_alloc(size_t offset, T * & value, Allocator & alloc) const {
+        msgpack_unpacked msg;
+        msgpack_unpacked_init(&msg);
+
+        if (msgpack_unpack_next(&msg, static_cast<const char *> (m_data), m_size, &offset) > 0) {
+
+            assert(msg.zone == nullptr);
+
+            msgpack_object obj = msg.data;
+            if (obj.type == MSGPACK_OBJECT_ARRAY) {
+                size_t count = obj.via.array.size;
+                // Each element takes at least one byte, so the size is checked before allocation
+                if (count && offset + count <= m_size) {
+                    T *temp = static_cast<T *> (alloc.Allocate(sizeof (T) * count, alignof (T)));
+                    if (temp) {
+                        for (size_t i = 0; i < count; i++) {
+                            if (!msgpack_read(offset, temp[i])) {
+                                return 0;
+                            }
+                        }
+                        value = temp;
+                        return count;
+                    }
+                }
+            } else if (std::is_same<uint8_t, T>::value && obj.type == MSGPACK_OBJECT_BIN && obj.via.bin.size) {
+                T *temp = static_cast<T *> (alloc.Allocate(obj.via.bin.size, alignof (T)));
+                if (temp) {
+                    memcpy(temp, obj.via.bin.ptr, obj.via.bin.size);
+                    value = temp;
+                    return obj.via.bin.size;
+                }
+            }
+        }
+        return 0;
+    }
+
+    size_t read_blob(size_t offset, uint8_t *data, size_t size) const;
+    const char * read_string(size_t offset, size_t *length) const;
+
+    bool field_key(size_t & offset, KeyType & id) const;
+    bool field_skip(size_t & offset) const;
+    bool field_end(size_t offset) const;
+
+    inline bool field_skip() {
+        return field_skip(m_offset);
+    }
+
+    inline bool check_key_type(char value) const {
         // Key ID can be a positive number only above zero
         // 
         // MessagePack int format family:
@@ -310,6 +701,683 @@ public:
     size_t m_offset;
 };
 
+
+/*
+ * Reader of columnar blocks made by Encoder::WriteBatch.
+ * The inherited Decoder methods work with the columns, where the value of each field is a blob with the column data.
+ * The column blob starts with a byte of the column kind (high 4 bits) and the width (low 4 bits),
+ * followed by the packed little-endian values, or by the end offsets of the encoded values and the values.
+ */
+class BatchDecoder : public Decoder {
+public:
+
+    enum ColumnKind {
+        ColumnEncoded = 0, ///< Encoded values with the offset table, the width is the size of an offset
+        ColumnUnsigned = 1,
+        ColumnSigned = 2,
+        ColumnFloat = 3, ///< float32 or float64 by the width
+        ColumnBool = 4,
+    };
+
+    static const size_t ValueSize = 9; ///< Maximum size of an encoded value of a packed column
+
+    BatchDecoder(const uint8_t *data, size_t size);
+
+    /**
+     * @return Number of records in the block, zero for invalid data
+     */
+    inline size_t GetCount() const {
+        return m_count;
+    }
+
+    /**
+     * Read all values of a numeric column without decoding the other columns
+     * @param id Field identifier
+     * @param values Buffer for the values
+     * @param size Size of the buffer in elements, must be at least GetCount()
+     * @return Number of values read, 0 on error
+     */
+    template < typename T>
+    typename std::enable_if<std::is_arithmetic<T>::value, size_t>::type
+    ReadColumn(KeyType id, T *values, size_t size) const {
+        Column column;
+        if (!values || size < m_count || !column_info(Lookup(id), column)) {
+            return 0;
+        }
+        for (size_t i = 0; i < m_count; i++) {
+            if (!column_get(column, i, values[i])) {
+                return 0;
+            }
+        }
+        return m_count;
+    }
+
+    /**
+     * Read a numeric value of a record in the column, in constant time
+     * @param column Column from Lookup or FieldNext
+     * @param index Record index
+     * @param value Receives the value
+     * @return Returns true if the value is read
+     */
+    template < typename T>
+    typename std::enable_if<std::is_arithmetic<T>::value, bool>::type
+    GetValue(const FieldRef & column, size_t index, T & value) const {
+        Column info;
+        return index < m_count && column_info(column, info) && column_get(info, index, value);
+    }
+
+    /**
+     * Get the encoded value of a record in the column, in constant time
+     * @param column Column from Lookup or FieldNext
+     * @param index Record index
+     * @param data Pointer to the encoded value in the block, or in the buffer for a packed column
+     * @param size Size of the encoded value including the array elements
+     * @param buffer At least ValueSize bytes to encode the value of a packed column
+     * @return Returns true if the value is found
+     */
+    bool ColumnValue(const FieldRef & column, size_t index, const uint8_t * & data, size_t & size, uint8_t *buffer) const;
+
+    SCOPE(protected) :
+
+    struct Column {
+        size_t kind;
+        size_t width; ///< Size of a packed value or of an offset
+        size_t data; ///< Offset of the packed values or of the offset table
+        size_t values; ///< Offset of the encoded values, the end of the packed values
+        size_t end;
+    };
+
+    bool column_range(const FieldRef & column, size_t & begin, size_t & end) const;
+    bool column_info(const FieldRef & column, Column & info) const;
+    bool column_encoded(const Column & info, size_t index, size_t & begin, size_t & end) const;
+
+    /*
+     * Packed value or offset with the index, signed values are extended to 64 bits
+     */
+    inline uint64_t column_bits(const Column & info, size_t index) const {
+        const uint8_t *data = GetBuffer() + info.data + index * info.width;
+        uint64_t bits = 0;
+        for (size_t i = info.width; i--;) {
+            bits = (bits << 8) | data[i];
+        }
+        if (info.kind == ColumnSigned && info.width < 8 && (bits >> (info.width * 8 - 1))) {
+            bits |= ~static_cast<uint64_t> (0) << (info.width * 8);
+        }
+        return bits;
+    }
+
+    template < typename T>
+    bool column_get(const Column & info, size_t index, T & value) const {
+        uint64_t bits;
+        switch (info.kind) {
+            case ColumnEncoded:
+            {
+                size_t begin;
+                size_t end;
+                return column_encoded(info, index, begin, end) && msgpack_read(begin, value) && begin == end;
+            }
+            case ColumnUnsigned:
+            {
+                bits = column_bits(info, index);
+                T temp = static_cast<T> (bits);
+                if (static_cast<uint64_t> (temp) != bits) { // check overflow
+                    return false;
+                }
+                value = temp;
+                return true;
+            }
+            case ColumnSigned:
+            {
+                int64_t signed_bits = static_cast<int64_t> (column_bits(info, index));
+                T temp = static_cast<T> (signed_bits);
+                if (static_cast<int64_t> (temp) != signed_bits) { // check overflow
+                    return false;
+                }
+                value = temp;
+                return true;
+            }
+            case ColumnFloat:
+                bits = column_bits(info, index);
+                if (info.width == sizeof (float)) {
+                    uint32_t single_bits = static_cast<uint32_t> (bits);
+                    float single;
+                    memcpy(&single, &single_bits, sizeof (single));
+                    value = static_cast<T> (single);
+                } else {
+                    double wide;
+                    memcpy(&wide, &bits, sizeof (wide));
+                    value = static_cast<T> (wide);
+                }
+                return true;
+            case ColumnBool:
+                value = static_cast<T> (column_bits(info, index) != 0);
+                return true;
+        }
+        return false;
+    }
+
+    SCOPE(private) :
+    size_t m_count;
+};
+
+/*
+ * Immutable index of the record fields for lookup in logarithmic time.
+ * After construction all methods are read only, so one index and decoder can be shared between threads without locks.
+ * The storage for the index is provided by the caller, the decoder and the storage must outlive the index.
+ */
+class Index {
+public:
+
+    /**
+     * @param decoder Record for indexing
+     * @param storage Buffer for the index
+     * @param capacity Size of the buffer in elements, if it is less than the number of fields, Lookup is passed to the decoder
+     * If the record has a decode error, the index is empty and IsValid returns false.
+     */
+    Index(const Decoder & decoder, FieldRef *storage, size_t capacity);
+
+    inline size_t GetCount() const {
+        return m_count;
+    }
+
+    inline bool IsIndexed() const {
+        return m_indexed;
+    }
+
+    inline bool IsValid() const {
+        return m_valid;
+    }
+
+    FieldRef Lookup(KeyType id) const;
+
+    template < typename T>
+    inline auto Get(KeyType id, T & value) const -> decltype(std::declval<const Decoder &>().Get(FieldRef(), value)) {
+        return m_decoder.Get(Lookup(id), value);
+    }
+
+    inline size_t Get(KeyType id, uint8_t *data, size_t size) const {
+        return m_decoder.Get(Lookup(id), data, size);
+    }
+
+    inline const char * GetAsString(KeyType id, size_t *length = nullptr) const {
+        return m_decoder.GetAsString(Lookup(id), length);
+    }
+
+    template < typename T, typename Allocator>
+    inline auto Get(KeyType id, T & value, Allocator & alloc) const -> decltype(std::declval<const Decoder &>().Get(FieldRef(), value, alloc)) {
+        return m_decoder.Get(Lookup(id), value, alloc);
+    }
+
+    SCOPE(private) :
+    const Decoder & m_decoder;
+    FieldRef *m_fields;
+    size_t m_count;
+    bool m_indexed;
+    bool m_valid;
+};
+
+/*
+ * Pool of cache line aligned buffers for encoding on one producer thread.
+ * The free list is used only by the owner thread, buffers released by other threads
+ * are pushed to a lock-free list and taken back by the owner all at once.
+ * The memory for the buffers is provided by the caller, the pool must outlive all handles.
+ */
+class BufferPool {
+public:
+
+    static const size_t CacheLine = 64;
+
+    /*
+     * Encoder bound to a buffer from the pool, the buffer is returned when the handle is destroyed.
+     * The handle can be moved to another thread.
+     */
+    class Handle : public Encoder {
+    public:
+
+        Handle();
+
+        Handle(Handle && other);
+
+        Handle & operator=(Handle && other);
+
+        virtual ~Handle();
+
+        inline explicit operator bool() const {
+            return m_pool != nullptr;
+        }
+
+        /**
+         * Return the buffer to the pool, can be called from any thread
+         */
+        void Release();
+
+        SCOPE(private) :
+        friend class BufferPool;
+
+        Handle(BufferPool *pool, uint8_t *data, size_t size);
+
+        Handle(const Handle &) = delete;
+        Handle & operator=(const Handle &) = delete;
+
+        BufferPool *m_pool;
+    };
+
+    /**
+     * @param memory Memory for the buffers
+     * @param size Size of the memory
+     * @param buffer_size Size of one buffer, rounded up to the cache line size
+     */
+    BufferPool(uint8_t *memory, size_t size, size_t buffer_size);
+
+    inline size_t GetCount() const {
+        return m_count;
+    }
+
+    inline size_t GetBufferSize() const {
+        return m_buffer_size;
+    }
+
+    /**
+     * Take a buffer from the pool, only for the owner thread
+     * @return Handle, false if all buffers are in use
+     */
+    Handle Acquire();
+
+    /**
+     * Return the buffer to the pool, can be called from any thread
+     * @param buffer Buffer from this pool
+     */
+    void Release(uint8_t *buffer);
+
+    SCOPE(private) :
+
+    struct Node {
+        Node *next;
+    };
+
+    BufferPool(const BufferPool &) = delete;
+    BufferPool & operator=(const BufferPool &) = delete;
+
+    size_t m_buffer_size;
+    size_t m_count;
+    Node *m_local; ///< Used only by the owner thread
+    alignas(CacheLine) std::atomic<Node *> m_remote; ///< Buffers released by any thread
+};
+
+/*
+ * Writer of records as JSON text into a caller buffer without memory allocation.
+ * If the sink is set, the buffer is passed to it when full, so the output size is not limited.
+ */
+class JsonWriter {
+public:
+
+    typedef bool (*Sink)(void *context, const char *data, size_t size);
+
+    JsonWriter(char *buffer, size_t size, Sink sink = nullptr, void *context = nullptr);
+
+    /**
+     * Write a record as JSON object {"id": value, ...} in one pass over the fields.
+     * Integers, true and false are written as is, floating point numbers with the shortest digits that read back
+     * to the same value (integral values with ".0" or an exponent) independently of the locale, strings as JSON strings,
+     * numeric arrays as JSON arrays, blobs (and groups) as {"base64": "..."}, NaN, infinity and nil as null.
+     * @param record Record to write
+     * @return Returns true on success. On error without the sink the buffer is not changed,
+     * with the sink the output can be incomplete.
+     */
+    bool Write(const Decoder & record);
+
+    /**
+     * Pass the buffered text to the sink
+     * @return Returns false if the sink is not set or fails
+     */
+    bool Flush();
+
+    inline void Reset() {
+        m_used = 0;
+    }
+
+    inline size_t GetUsed() const {
+        return m_used;
+    }
+
+    inline const char * GetBuffer() const {
+        return m_data;
+    }
+
+    SCOPE(protected) :
+
+    inline bool put(char value) {
+        if (m_used >= m_size && !Flush()) {
+            return false;
+        }
+        m_data[m_used++] = value;
+        return true;
+    }
+
+    inline bool put(const char *data, size_t size) {
+        if (size <= m_size - m_used) {
+            memcpy(&m_data[m_used], data, size);
+            m_used += size;
+            return true;
+        }
+        return put_chunks(data, size);
+    }
+
+    bool put_chunks(const char *data, size_t size);
+    bool put_unsigned(uint64_t value);
+    bool put_signed(int64_t value);
+    bool put_double(double value, bool single);
+    bool put_string(const char *data, size_t size);
+    bool put_base64(const uint8_t *data, size_t size);
+    bool put_value(const char *data, size_t size, size_t & offset, bool nested);
+    bool write_record(const Decoder & record);
+
+    SCOPE(private) :
+    char *m_data;
+    size_t m_size;
+    size_t m_used;
+    Sink m_sink;
+    void *m_context;
+};
+
+#if __cplusplus >= 201402L
+
+/*
+ * Compile time encoding of records (C++14 and later), for example, to store settings in the program flash memory.
+ * The result is byte-identical to the Encoder output with the default settings.
+ * Negative zero of float and double keeps its sign with GCC and Clang, other compilers store it as positive zero.
+ *
+ * constexpr auto config = MICROPROP_BAKE(bake::Field(1, 100), bake::Field(2, 0.5), bake::String(3, "name"));
+ * Decoder dec(config.data(), config.size());
+ */
+namespace bake {
+
+/*
+ * Writes bytes to the buffer, or only counts them if the buffer is not specified.
+ */
+class Writer {
+public:
+
+    constexpr Writer(uint8_t *data) : m_data(data), m_used(0) {
+    }
+
+    constexpr size_t GetUsed() const {
+        return m_used;
+    }
+
+    constexpr void Put(uint8_t value) {
+        if (m_data) {
+            m_data[m_used] = value;
+        }
+        m_used++;
+    }
+
+    constexpr void PutBigEndian(uint64_t value, size_t size) {
+        for (size_t i = size; i-- > 0;) {
+            Put(static_cast<uint8_t> (value >> (8 * i)));
+        }
+    }
+
+    constexpr void PutUnsigned(uint64_t value) {
+        if (value < 0x80) {
+            Put(static_cast<uint8_t> (value));
+        } else if (value <= 0xFF) {
+            Put(0xCC);
+            PutBigEndian(value, 1);
+        } else if (value <= 0xFFFF) {
+            Put(0xCD);
+            PutBigEndian(value, 2);
+        } else if (value <= 0xFFFFFFFF) {
+            Put(0xCE);
+            PutBigEndian(value, 4);
+        } else {
+            Put(0xCF);
+            PutBigEndian(value, 8);
+        }
+    }
+
+    constexpr void PutSigned(int64_t value) {
+        if (value >= 0) {
+            PutUnsigned(static_cast<uint64_t> (value));
+        } else if (value >= -32) {
+            Put(static_cast<uint8_t> (value));
+        } else if (value >= INT8_MIN) {
+            Put(0xD0);
+            PutBigEndian(static_cast<uint64_t> (value), 1);
+        } else if (value >= INT16_MIN) {
+            Put(0xD1);
+            PutBigEndian(static_cast<uint64_t> (value), 2);
+        } else if (value >= INT32_MIN) {
+            Put(0xD2);
+            PutBigEndian(static_cast<uint64_t> (value), 4);
+        } else {
+            Put(0xD3);
+            PutBigEndian(static_cast<uint64_t> (value), 8);
+        }
+    }
+
+    template < typename T>
+    constexpr void PutNumber(T value) {
+        if (std::is_same<bool, T>::value) {
+            Put(value ? 0xC3 : 0xC2);
+        } else if (std::is_same<float, T>::value) {
+            Put(0xCA);
+            PutBigEndian(ieee_bits(static_cast<double> (value), 23, 8), 4);
+        } else if (std::is_floating_point<T>::value) {
+            Put(0xCB);
+            PutBigEndian(ieee_bits(static_cast<double> (value), 52, 11), 8);
+        } else if (std::is_signed<T>::value) {
+            PutSigned(static_cast<int64_t> (value));
+        } else {
+            PutUnsigned(static_cast<uint64_t> (value));
+        }
+    }
+
+    constexpr void PutKey(KeyType id) {
+        if (!id) {
+            invalid_field_id(); // Compile error: zero field identifier
+        }
+        PutUnsigned(id);
+    }
+
+    constexpr void PutHeader(uint8_t fix, uint8_t fix_limit, uint8_t code8, uint8_t code16, uint8_t code32, size_t size) {
+        if (fix && size < fix_limit) {
+            Put(static_cast<uint8_t> (fix | size));
+        } else if (code8 && size <= 0xFF) {
+            Put(code8);
+            PutBigEndian(size, 1);
+        } else if (size <= 0xFFFF) {
+            Put(code16);
+            PutBigEndian(size, 2);
+        } else {
+            Put(code32);
+            PutBigEndian(size, 4);
+        }
+    }
+
+    /*
+     * IEEE 754 bit pattern without type punning, which is not allowed in constant expressions.
+     * The value must be exactly representable in the target format.
+     */
+    static constexpr uint64_t ieee_bits(double value, int mantissa, int exponent) {
+        const int bias = (1 << (exponent - 1)) - 1;
+        const uint64_t exp_max = (uint64_t(1) << exponent) - 1;
+        const double scale = static_cast<double> (uint64_t(1) << mantissa);
+
+        if (!(value < 0) && !(value >= 0)) { // NaN
+            return (exp_max << mantissa) | (uint64_t(1) << (mantissa - 1));
+        }
+        uint64_t sign = 0;
+        if (sign_bit(value)) {
+            sign = uint64_t(1) << (mantissa + exponent);
+            value = -value;
+        }
+        if (!(value > 0)) {
+            return sign;
+        }
+        int exp = 0;
+        while (value >= 2) {
+            value /= 2;
+            if (++exp > bias) { // Infinity
+                return sign | (exp_max << mantissa);
+            }
+        }
+        while (value < 1 && exp > 1 - bias) {
+            value *= 2;
+            exp--;
+        }
+        if (value < 1) { // Subnormal
+            return sign | static_cast<uint64_t> (value * scale);
+        }
+        return sign | (static_cast<uint64_t> (exp + bias) << mantissa) | static_cast<uint64_t> ((value - 1) * scale);
+    }
+
+    /*
+     * Sign of the value including negative zero, std::signbit is not allowed in constant expressions
+     */
+    static constexpr bool sign_bit(double value) {
+#ifdef __GNUC__
+        return __builtin_copysign(1.0, value) < 0;
+#else
+        return value < 0;
+#endif
+    }
+
+    static void invalid_field_id() {
+    }
+
+    static void size_mismatch() {
+    }
+
+private:
+    uint8_t *m_data;
+    size_t m_used;
+};
+
+template < typename T>
+struct NumberField {
+    KeyType id;
+    T value;
+
+    constexpr void Put(Writer & w) const {
+        w.PutKey(id);
+        w.PutNumber(value);
+    }
+};
+
+template < typename T, size_t N>
+struct ArrayField {
+    KeyType id;
+    T value[N] = {};
+
+    constexpr ArrayField(KeyType key, const T(&data)[N]) : id(key) {
+        for (size_t i = 0; i < N; i++) {
+            value[i] = data[i];
+        }
+    }
+
+    constexpr void Put(Writer & w) const {
+        w.PutKey(id);
+        w.PutHeader(0x90, 16, 0, 0xDC, 0xDD, N);
+        for (size_t i = 0; i < N; i++) {
+            w.PutNumber(value[i]);
+        }
+    }
+};
+
+template < size_t N>
+struct BytesField {
+    KeyType id;
+    bool is_string;
+    uint8_t value[N] = {};
+    size_t size;
+
+    constexpr BytesField(KeyType key, const uint8_t(&data)[N]) : id(key), is_string(false), size(N) {
+        for (size_t i = 0; i < N; i++) {
+            value[i] = data[i];
+        }
+    }
+
+    constexpr BytesField(KeyType key, const char(&str)[N]) : id(key), is_string(true), size(0) {
+        // Same as Encoder::WriteAsString, up to the first null char and including it
+        while (size < N && str[size]) {
+            value[size] = static_cast<uint8_t> (str[size]);
+            size++;
+        }
+        if (size < N) {
+            size++;
+        }
+    }
+
+    constexpr void Put(Writer & w) const {
+        w.PutKey(id);
+        if (is_string) {
+            w.PutHeader(0xA0, 32, 0xD9, 0xDA, 0xDB, size);
+        } else {
+            w.PutHeader(0, 0, 0xC4, 0xC5, 0xC6, size);
+        }
+        for (size_t i = 0; i < size; i++) {
+            w.Put(value[i]);
+        }
+    }
+};
+
+template < typename T>
+constexpr typename std::enable_if<std::is_arithmetic<T>::value, NumberField<T>>::type
+Field(KeyType id, T value) {
+    return NumberField<T>{id, value};
+}
+
+template < typename T, size_t N>
+constexpr typename std::enable_if<std::is_arithmetic<T>::value, ArrayField<T, N>>::type
+Field(KeyType id, const T(&value)[N]) {
+    return ArrayField<T, N>(id, value);
+}
+
+template < size_t N>
+constexpr BytesField<N> Blob(KeyType id, const uint8_t(&data)[N]) {
+    return BytesField<N>(id, data);
+}
+
+template < size_t N>
+constexpr BytesField<N> String(KeyType id, const char(&str)[N]) {
+    return BytesField<N>(id, str);
+}
+
+template < typename ... Fields>
+constexpr size_t Size(const Fields & ... fields) {
+    Writer w(nullptr);
+    int order[] = {0, (fields.Put(w), 0)...};
+    (void) order;
+    return w.GetUsed();
+}
+
+template < size_t N, size_t ... I>
+constexpr std::array<uint8_t, N> to_array(const uint8_t *data, std::index_sequence<I...>) {
+    return std::array<uint8_t, N>{{data[I]...}};
+}
+
+template < size_t N, typename ... Fields>
+constexpr std::array<uint8_t, N> Make(const Fields & ... fields) {
+    uint8_t data[N + 1] = {};
+    Writer w(data);
+    int order[] = {0, (fields.Put(w), 0)...};
+    (void) order;
+    if (w.GetUsed() != N) {
+        Writer::size_mismatch(); // Compile error: use Size() for the template argument
+    }
+    return to_array<N>(data, std::make_index_sequence<N>());
+}
+
+}
+
+/*
+ * Record with the size computed at compile time, the fields are evaluated twice.
+ */
+#define MICROPROP_BAKE(...) microprop::bake::Make<microprop::bake::Size(__VA_ARGS__)>(__VA_ARGS__)
+
+#endif
+
 }
 #endif /* MICROPROPERTY_H */
 
@@ -0,0 +1,81 @@
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wctor-dtor-privacy"
+#pragma GCC diagnostic ignored "-Wfloat-conversion"
+#pragma GCC diagnostic ignored "-Wsign-compare"
+#pragma GCC diagnostic ignored "-Wsign-conversion"
+#pragma GCC diagnostic ignored "-Wconversion"
+#pragma GCC diagnostic ignored "-Wfloat-equal"
+#pragma GCC diagnostic ignored "-Wzero-as-null-pointer-constant"
+#include <gtest/gtest.h>
+#include <cmath>
+
+// Open private members for tests
+#define SCOPE(scope) public
+
+#include "microprop.h"
+
+/*
+ * Compile time records need C++14, this file is built with -std=c++14 while the rest of the tests use C++11
+ */
+#if __cplusplus < 201402L
+#error "Build microprop_bake_test.cpp with -std=c++14 or later"
+#endif
+
+using namespace microprop;
+
+TEST(Microprop, Bake) {
+
+    constexpr auto baked = MICROPROP_BAKE(
+            bake::Field(1, true),
+            bake::Field(2, -25),
+            bake::Field(300, static_cast<uint16_t> (333)),
+            bake::Field(500001, 0xFFFFFFFFFFFFFFFF - 1),
+            bake::Field(5, -100000L),
+            bake::Field(0xF, 1.123f),
+            bake::Field(0xDDDD, 0.123),
+            bake::Field(6, -1.5e-310), // subnormal
+            bake::Field(7, {1, 2, 300, -400}),
+            bake::Field(8, {1.1f, -2.2f}),
+            bake::String(9, "string"),
+            bake::Blob(10, {0, 1, 2, 255}),
+            bake::Field(11, -0.0),
+            bake::Field(12, -0.0f));
+
+    STATIC_ASSERT(baked.size() == 112);
+
+    uint8_t buffer[200];
+    Encoder enc(buffer, sizeof (buffer));
+    EXPECT_TRUE(enc.Write(1, true));
+    EXPECT_TRUE(enc.Write(2, -25));
+    EXPECT_TRUE(enc.Write(300, static_cast<uint16_t> (333)));
+    EXPECT_TRUE(enc.Write(500001, 0xFFFFFFFFFFFFFFFF - 1));
+    EXPECT_TRUE(enc.Write(5, -100000L));
+    EXPECT_TRUE(enc.Write(0xF, 1.123f));
+    EXPECT_TRUE(enc.Write(0xDDDD, 0.123));
+    EXPECT_TRUE(enc.Write(6, -1.5e-310));
+    int a[] = {1, 2, 300, -400};
+    EXPECT_TRUE(enc.Write(7, a));
+    float f[] = {1.1f, -2.2f};
+    EXPECT_TRUE(enc.Write(8, f));
+    EXPECT_TRUE(enc.WriteAsString(9, "string"));
+    uint8_t blob[] = {0, 1, 2, 255};
+    EXPECT_TRUE(enc.Write(10, blob, sizeof (blob)));
+    EXPECT_TRUE(enc.Write(11, -0.0));
+    EXPECT_TRUE(enc.Write(12, -0.0f));
+
+    ASSERT_EQ(enc.GetUsed(), baked.size());
+    EXPECT_TRUE(memcmp(buffer, baked.data(), baked.size()) == 0);
+
+    Decoder dec(baked.data(), baked.size());
+    double d;
+    EXPECT_TRUE(dec.Read(0xDDDD, d));
+    EXPECT_EQ(0.123, d);
+    EXPECT_STREQ("string", dec.ReadAsString(9));
+    EXPECT_TRUE(dec.Read(11, d));
+    EXPECT_TRUE(std::signbit(d));
+
+    constexpr auto empty = MICROPROP_BAKE();
+    STATIC_ASSERT(empty.size() == 0);
+}
+
+#pragma GCC diagnostic pop
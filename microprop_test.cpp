@@ -7,6 +7,12 @@
 #pragma GCC diagnostic ignored "-Wfloat-equal"
 #pragma GCC diagnostic ignored "-Wzero-as-null-pointer-constant"
 #include <gtest/gtest.h>
+#include <cmath>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 // Open private members for tests
 #define SCOPE(scope) public
@@ -336,6 +342,1175 @@ TEST(Microprop, Array) {
     }
 }
 
+TEST(Microprop, CompactFloat) {
+
+    uint8_t buffer[200];
+    Encoder enc(buffer, sizeof (buffer));
+    EXPECT_FALSE(enc.GetCompactFloat());
+    enc.SetCompactFloat(true);
+    EXPECT_TRUE(enc.GetCompactFloat());
+
+    EXPECT_TRUE(enc.Write(1, 0.0));
+    EXPECT_EQ(2, enc.GetUsed()); // positive fixnum
+    EXPECT_TRUE(enc.Write(2, -5.0));
+    EXPECT_EQ(4, enc.GetUsed()); // negative fixnum
+    EXPECT_TRUE(enc.Write(3, 300.0f));
+    EXPECT_EQ(8, enc.GetUsed()); // uint16
+    EXPECT_TRUE(enc.Write(4, 0.5));
+    EXPECT_EQ(14, enc.GetUsed()); // float32
+    EXPECT_TRUE(enc.Write(5, 0.1));
+    EXPECT_EQ(24, enc.GetUsed()); // float64
+    EXPECT_TRUE(enc.Write(6, -0.0));
+    EXPECT_EQ(30, enc.GetUsed()); // float32 with sign
+    EXPECT_TRUE(enc.Write(7, 1099511627776.0));
+    EXPECT_EQ(36, enc.GetUsed()); // 2^40 as float32
+    EXPECT_TRUE(enc.Write(8, 1.1f));
+    EXPECT_EQ(42, enc.GetUsed());
+
+    double d[4] = {1.0, 2.5, 0.1, -100000.0};
+    EXPECT_TRUE(enc.Write(9, d));
+    EXPECT_EQ(64, enc.GetUsed()); // 1 + 1 + (1 + 5 + 9 + 5)
+
+    Decoder dec(buffer, enc.GetUsed());
+
+    double read_d = 1;
+    float read_f = 1;
+    EXPECT_TRUE(dec.Read(1, read_d));
+    EXPECT_EQ(0.0, read_d);
+    EXPECT_TRUE(dec.Read(2, read_d));
+    EXPECT_EQ(-5.0, read_d);
+    EXPECT_TRUE(dec.Read(3, read_f));
+    EXPECT_EQ(300.0f, read_f);
+    EXPECT_TRUE(dec.Read(4, read_d));
+    EXPECT_EQ(0.5, read_d);
+    EXPECT_TRUE(dec.Read(5, read_d));
+    EXPECT_EQ(0.1, read_d);
+    EXPECT_TRUE(dec.Read(6, read_d));
+    EXPECT_EQ(0.0, read_d);
+    EXPECT_TRUE(std::signbit(read_d));
+    EXPECT_TRUE(dec.Read(7, read_d));
+    EXPECT_EQ(1099511627776.0, read_d);
+    EXPECT_TRUE(dec.Read(8, read_f));
+    EXPECT_EQ(1.1f, read_f);
+
+    double dres[4];
+    EXPECT_EQ(4, dec.Read(9, dres));
+    EXPECT_TRUE(memcmp(d, dres, sizeof (d)) == 0);
+
+    // Integers not exact as float32 are stored as uint32 and read into float as without the compact mode
+    Encoder wide(buffer, sizeof (buffer));
+    wide.SetCompactFloat(true);
+    EXPECT_TRUE(wide.Write(1, 16777217.0));
+    EXPECT_EQ(6, wide.GetUsed());
+    EXPECT_TRUE(wide.Write(2, 4294967295.0));
+    EXPECT_EQ(12, wide.GetUsed());
+    Decoder wide_dec(buffer, wide.GetUsed());
+    EXPECT_TRUE(wide_dec.Read(1, read_f));
+    EXPECT_EQ(static_cast<float> (16777217.0), read_f);
+    EXPECT_TRUE(wide_dec.Read(2, read_f));
+    EXPECT_EQ(static_cast<float> (4294967295.0), read_f);
+    EXPECT_TRUE(wide_dec.Read(2, read_d));
+    EXPECT_EQ(4294967295.0, read_d);
+    int16_t read_i16;
+    EXPECT_FALSE(wide_dec.Read(2, read_i16)); // overflow
+}
+
+TEST(Microprop, Diff) {
+
+    uint8_t base_buf[100];
+    uint8_t current_buf[100];
+    uint8_t patch_buf[100];
+    uint8_t result_buf[100];
+
+    uint16_t a16[3] = {10, 20, 30};
+    uint16_t a16_new[3] = {10, 20, 31};
+
+    Encoder base(base_buf, sizeof (base_buf));
+    EXPECT_TRUE(base.Write(1, 100));
+    EXPECT_TRUE(base.Write(2, a16));
+    EXPECT_TRUE(base.WriteAsString(3, "str"));
+    EXPECT_TRUE(base.Write(4, true));
+    EXPECT_TRUE(base.Write(5, 0.5));
+
+    Encoder current(current_buf, sizeof (current_buf));
+    EXPECT_TRUE(current.Write(1, 100));
+    EXPECT_TRUE(current.Write(2, a16_new)); // changed
+    EXPECT_TRUE(current.WriteAsString(3, "str"));
+    EXPECT_TRUE(current.Write(5, 1.5)); // changed, 4 removed
+    EXPECT_TRUE(current.Write(6, -1)); // added
+
+    Decoder base_dec(base_buf, base.GetUsed());
+    Decoder current_dec(current_buf, current.GetUsed());
+
+    Encoder patch(patch_buf, sizeof (patch_buf));
+    ASSERT_TRUE(patch.WriteDiff(base_dec, current_dec));
+    EXPECT_EQ(19, patch.GetUsed()); // 2:[3] 4:nil 5:double 6:int
+
+    Decoder patch_dec(patch_buf, patch.GetUsed());
+    KeyType id;
+    EXPECT_TRUE(patch_dec.FieldNext(id));
+    EXPECT_EQ(2, id);
+    EXPECT_TRUE(patch_dec.FieldNext(id));
+    EXPECT_EQ(4, id);
+    EXPECT_TRUE(patch_dec.FieldNext(id));
+    EXPECT_EQ(5, id);
+    EXPECT_TRUE(patch_dec.FieldNext(id));
+    EXPECT_EQ(6, id);
+    EXPECT_FALSE(patch_dec.FieldNext(id));
+
+    Encoder result(result_buf, sizeof (result_buf));
+    ASSERT_TRUE(result.WritePatch(base_dec, patch_dec));
+    ASSERT_EQ(current.GetUsed(), result.GetUsed());
+    EXPECT_TRUE(memcmp(current_buf, result_buf, current.GetUsed()) == 0);
+
+    // Same records make an empty patch
+    Encoder empty(patch_buf, sizeof (patch_buf));
+    EXPECT_TRUE(empty.WriteDiff(current_dec, current_dec));
+    EXPECT_EQ(0, empty.GetUsed());
+
+    // Not enough space, the buffer is not changed
+    Encoder small(patch_buf, 10);
+    EXPECT_FALSE(small.WriteDiff(base_dec, current_dec));
+    EXPECT_EQ(0, small.GetUsed());
+
+    // The last field is an array
+    int16_t tail[3] = {1, 2, 3};
+    int16_t tail_new[3] = {1, 2, 4};
+    Encoder base_tail(base_buf, sizeof (base_buf));
+    EXPECT_TRUE(base_tail.Write(1, 10));
+    EXPECT_TRUE(base_tail.Write(2, tail));
+    Encoder current_tail(current_buf, sizeof (current_buf));
+    EXPECT_TRUE(current_tail.Write(1, 11));
+    EXPECT_TRUE(current_tail.Write(2, tail_new));
+
+    Decoder base_tail_dec(base_buf, base_tail.GetUsed());
+    Decoder current_tail_dec(current_buf, current_tail.GetUsed());
+    Encoder patch_tail(patch_buf, sizeof (patch_buf));
+    ASSERT_TRUE(patch_tail.WriteDiff(base_tail_dec, current_tail_dec));
+    EXPECT_EQ(current_tail.GetUsed(), patch_tail.GetUsed()); // both fields changed
+
+    Decoder patch_tail_dec(patch_buf, patch_tail.GetUsed());
+    Encoder result_tail(result_buf, sizeof (result_buf));
+    ASSERT_TRUE(result_tail.WritePatch(base_tail_dec, patch_tail_dec));
+    ASSERT_EQ(current_tail.GetUsed(), result_tail.GetUsed());
+    EXPECT_TRUE(memcmp(current_buf, result_buf, current_tail.GetUsed()) == 0);
+
+    // Truncated array is an error
+    Decoder truncated(current_buf, current_tail.GetUsed() - 1);
+    EXPECT_TRUE(truncated.FieldFind(2));
+    const uint8_t *value;
+    size_t size;
+    EXPECT_FALSE(truncated.FieldValue(value, size));
+    EXPECT_FALSE(patch_tail.WriteDiff(base_tail_dec, truncated));
+
+    // Truncated key of the last field is not the end of the record, the buffer is not changed
+    Encoder base_key(base_buf, sizeof (base_buf));
+    EXPECT_TRUE(base_key.Write(1, 10));
+    EXPECT_TRUE(base_key.Write(1000, 5));
+    Decoder base_key_dec(base_buf, base_key.GetUsed());
+    Decoder truncated_key(base_buf, base_key.GetUsed() - 2);
+    Decoder empty_dec(patch_buf, 0);
+    Encoder patch_key(result_buf, sizeof (result_buf));
+    EXPECT_TRUE(patch_key.Write(1, 1));
+    size_t used = patch_key.GetUsed();
+    EXPECT_FALSE(patch_key.WriteDiff(truncated_key, base_key_dec));
+    EXPECT_EQ(used, patch_key.GetUsed());
+    EXPECT_FALSE(patch_key.WriteDiff(base_key_dec, truncated_key));
+    EXPECT_EQ(used, patch_key.GetUsed());
+    EXPECT_FALSE(patch_key.WritePatch(truncated_key, empty_dec));
+    EXPECT_EQ(used, patch_key.GetUsed());
+    EXPECT_FALSE(patch_key.WritePatch(base_key_dec, truncated_key));
+    EXPECT_EQ(used, patch_key.GetUsed());
+    EXPECT_TRUE(patch_key.WritePatch(base_key_dec, empty_dec));
+    EXPECT_EQ(used + base_key.GetUsed(), patch_key.GetUsed());
+}
+
+TEST(Microprop, DiffOrder) {
+
+    uint8_t base_buf[50];
+    uint8_t current_buf[50];
+    uint8_t patch_buf[50];
+    uint8_t result_buf[50];
+
+    Encoder base(base_buf, sizeof (base_buf));
+    EXPECT_TRUE(base.Write(1, 1));
+    EXPECT_TRUE(base.Write(2, 2));
+    EXPECT_TRUE(base.Write(3, 3));
+
+    Encoder current(current_buf, sizeof (current_buf));
+    EXPECT_TRUE(current.Write(3, 3));
+    EXPECT_TRUE(current.Write(2, 20));
+    EXPECT_TRUE(current.Write(1, 1));
+
+    Decoder base_dec(base_buf, base.GetUsed());
+    Decoder current_dec(current_buf, current.GetUsed());
+
+    Decoder seek(current_buf, current.GetUsed());
+    EXPECT_TRUE(seek.FieldSeek(2));
+    EXPECT_TRUE(seek.FieldSeek(3)); // continue from the beginning
+    EXPECT_TRUE(seek.FieldSeek(1));
+    EXPECT_FALSE(seek.FieldSeek(4));
+
+    Encoder patch(patch_buf, sizeof (patch_buf));
+    ASSERT_TRUE(patch.WriteDiff(base_dec, current_dec));
+    EXPECT_EQ(2, patch.GetUsed());
+
+    Decoder patch_dec(patch_buf, patch.GetUsed());
+    Encoder result(result_buf, sizeof (result_buf));
+    ASSERT_TRUE(result.WritePatch(base_dec, patch_dec));
+
+    // Fields are restored in the base order
+    Decoder dec(result_buf, result.GetUsed());
+    int value;
+    EXPECT_TRUE(dec.Read(1, value));
+    EXPECT_EQ(1, value);
+    EXPECT_TRUE(dec.Read(2, value));
+    EXPECT_EQ(20, value);
+    EXPECT_TRUE(dec.Read(3, value));
+    EXPECT_EQ(3, value);
+    EXPECT_EQ(base.GetUsed(), result.GetUsed());
+}
+
+TEST(Microprop, Merge) {
+
+    uint8_t def_buf[50];
+    uint8_t site_buf[50];
+    uint8_t device_buf[50];
+    uint8_t result_buf[100];
+
+    uint8_t a8[3] = {1, 2, 3};
+
+    Encoder def(def_buf, sizeof (def_buf));
+    EXPECT_TRUE(def.Write(1, 1));
+    EXPECT_TRUE(def.Write(2, 2));
+    EXPECT_TRUE(def.Write(3, a8));
+    EXPECT_TRUE(def.WriteAsString(4, "default"));
+
+    Encoder site(site_buf, sizeof (site_buf));
+    EXPECT_TRUE(site.Write(2, 20));
+    EXPECT_TRUE(site.WriteAsString(4, "site"));
+    EXPECT_TRUE(site.Write(5, 0.5));
+
+    Encoder device(device_buf, sizeof (device_buf));
+    EXPECT_TRUE(device.Write(4, 400));
+    EXPECT_TRUE(device.Write(6, true));
+
+    Decoder def_dec(def_buf, def.GetUsed());
+    Decoder site_dec(site_buf, site.GetUsed());
+    Decoder device_dec(device_buf, device.GetUsed());
+
+    KeyType seen[8];
+    Encoder result(result_buf, sizeof (result_buf));
+    ASSERT_TRUE(result.Merge(seen, def_dec, site_dec, device_dec));
+
+    Decoder dec(result_buf, result.GetUsed());
+    KeyType id;
+    KeyType order[] = {4, 6, 2, 5, 1, 3};
+    for (size_t i = 0; i < sizeof (order) / sizeof (order[0]); i++) {
+        EXPECT_TRUE(dec.FieldNext(id));
+        EXPECT_EQ(order[i], id);
+    }
+    EXPECT_FALSE(dec.FieldNext(id));
+
+    int value;
+    EXPECT_TRUE(dec.Read(1, value));
+    EXPECT_EQ(1, value);
+    EXPECT_TRUE(dec.Read(2, value));
+    EXPECT_EQ(20, value);
+    EXPECT_TRUE(dec.Read(4, value));
+    EXPECT_EQ(400, value);
+    uint8_t a8_res[3];
+    EXPECT_EQ(3, dec.Read(3, a8_res));
+    EXPECT_TRUE(memcmp(a8, a8_res, sizeof (a8)) == 0);
+    double d;
+    EXPECT_TRUE(dec.Read(5, d));
+    EXPECT_EQ(0.5, d);
+    bool b = false;
+    EXPECT_TRUE(dec.Read(6, b));
+    EXPECT_TRUE(b);
+
+    // Too small set of keys
+    KeyType small_seen[4];
+    Encoder small(result_buf, sizeof (result_buf));
+    EXPECT_FALSE(small.Merge(small_seen, def_dec, site_dec, device_dec));
+    EXPECT_EQ(0, small.GetUsed());
+
+    // Layers end with an array field
+    int16_t a16[2] = {-1, 1000};
+    Encoder def_tail(def_buf, sizeof (def_buf));
+    EXPECT_TRUE(def_tail.Write(1, 1));
+    EXPECT_TRUE(def_tail.Write(2, a8));
+    Encoder site_tail(site_buf, sizeof (site_buf));
+    EXPECT_TRUE(site_tail.Write(3, 3));
+    EXPECT_TRUE(site_tail.Write(2, a16));
+
+    Decoder def_tail_dec(def_buf, def_tail.GetUsed());
+    Decoder site_tail_dec(site_buf, site_tail.GetUsed());
+    Encoder result_tail(result_buf, sizeof (result_buf));
+    ASSERT_TRUE(result_tail.Merge(seen, def_tail_dec, site_tail_dec));
+
+    Decoder tail_dec(result_buf, result_tail.GetUsed());
+    int16_t a16_res[2];
+    EXPECT_EQ(2, tail_dec.Read(2, a16_res));
+    EXPECT_TRUE(memcmp(a16, a16_res, sizeof (a16)) == 0);
+    EXPECT_TRUE(tail_dec.Read(1, value));
+    EXPECT_EQ(1, value);
+    EXPECT_TRUE(tail_dec.Read(3, value));
+    EXPECT_EQ(3, value);
+    EXPECT_EQ(def_tail.GetUsed() - 5 + site_tail.GetUsed(), result_tail.GetUsed()); // without 2:[3] of the defaults
+
+    // Truncated key in a layer is a decode error, the buffer is not changed
+    EXPECT_TRUE(def_tail.Write(1000, 5));
+    Decoder truncated(def_buf, def_tail.GetUsed() - 2);
+    Encoder result_truncated(result_buf, sizeof (result_buf));
+    EXPECT_FALSE(result_truncated.Merge(seen, truncated, site_tail_dec));
+    EXPECT_EQ(0, result_truncated.GetUsed());
+    EXPECT_FALSE(result_truncated.Merge(seen, site_tail_dec, truncated));
+    EXPECT_EQ(0, result_truncated.GetUsed());
+}
+
+
+TEST(Microprop, Lookup) {
+
+    uint8_t buffer[200];
+    Encoder enc(buffer, sizeof (buffer));
+
+    uint16_t a16[3] = {10, 20, 30};
+    uint8_t blob[4] = {1, 2, 3, 4};
+
+    EXPECT_TRUE(enc.Write(5, 500));
+    EXPECT_TRUE(enc.Write(3, a16));
+    EXPECT_TRUE(enc.WriteAsString(1000, "str"));
+    EXPECT_TRUE(enc.Write(7, blob, sizeof (blob)));
+    EXPECT_TRUE(enc.Write(2, 0.5));
+    EXPECT_TRUE(enc.Write(5, 555)); // duplicate key, the first one is used
+
+    const Decoder dec(buffer, enc.GetUsed());
+
+    FieldRef field = dec.Lookup(3);
+    EXPECT_TRUE(field);
+    EXPECT_EQ(3, field.id);
+    EXPECT_EQ(4, field.size);
+    EXPECT_FALSE(dec.Lookup(4));
+
+    int value;
+    EXPECT_TRUE(dec.Get(5, value));
+    EXPECT_EQ(500, value);
+    uint16_t a16_res[3];
+    EXPECT_EQ(3, dec.Get(field, a16_res));
+    EXPECT_TRUE(memcmp(a16, a16_res, sizeof (a16)) == 0);
+    EXPECT_STREQ("str", dec.GetAsString(1000));
+    uint8_t blob_res[10];
+    EXPECT_EQ(4, dec.Get(7, blob_res, sizeof (blob_res)));
+    EXPECT_TRUE(memcmp(blob, blob_res, sizeof (blob)) == 0);
+    EXPECT_FALSE(dec.Get(4, value));
+
+    FieldRef storage[10];
+    const Index index(dec, storage, 10);
+    EXPECT_TRUE(index.IsIndexed());
+    EXPECT_EQ(6, index.GetCount());
+
+    EXPECT_TRUE(index.Get(5, value));
+    EXPECT_EQ(500, value);
+    double d;
+    EXPECT_TRUE(index.Get(2, d));
+    EXPECT_EQ(0.5, d);
+    EXPECT_EQ(3, index.Get(3, a16_res));
+    EXPECT_TRUE(memcmp(a16, a16_res, sizeof (a16)) == 0);
+    EXPECT_STREQ("str", index.GetAsString(1000));
+    EXPECT_EQ(4, index.Get(7, blob_res, sizeof (blob_res)));
+    EXPECT_FALSE(index.Lookup(4));
+    EXPECT_FALSE(index.Get(4, value));
+
+    // Not enough space, search in the decoder
+    const Index small(dec, storage, 3);
+    EXPECT_FALSE(small.IsIndexed());
+    EXPECT_TRUE(small.Get(5, value));
+    EXPECT_EQ(500, value);
+    EXPECT_STREQ("str", small.GetAsString(1000));
+    EXPECT_TRUE(small.IsValid());
+
+    // The last field is an array
+    Encoder tail(buffer, sizeof (buffer));
+    EXPECT_TRUE(tail.Write(1, 10));
+    EXPECT_TRUE(tail.Write(2, a16));
+    const Decoder tail_dec(buffer, tail.GetUsed());
+    EXPECT_TRUE(tail_dec.Lookup(2));
+    EXPECT_EQ(3, tail_dec.Get(2, a16_res));
+    const Index tail_index(tail_dec, storage, 10);
+    EXPECT_EQ(2, tail_index.GetCount());
+    EXPECT_TRUE(tail_index.IsValid());
+
+    KeyType id;
+    FieldRef last = FieldRef();
+    EXPECT_TRUE(tail_dec.FieldNext(last));
+    EXPECT_TRUE(tail_dec.FieldNext(last));
+    EXPECT_FALSE(tail_dec.FieldNext(last));
+    EXPECT_EQ(2, last.id);
+    EXPECT_TRUE(tail_dec.FieldEnd(last));
+
+    // Decode error is not the end of the record
+    const Decoder truncated(buffer, tail.GetUsed() - 1);
+    last = FieldRef();
+    EXPECT_TRUE(truncated.FieldNext(last));
+    EXPECT_FALSE(truncated.FieldNext(last));
+    EXPECT_EQ(1, last.id);
+    EXPECT_FALSE(truncated.FieldEnd(last));
+    const Index truncated_index(truncated, storage, 10);
+    EXPECT_FALSE(truncated_index.IsValid());
+    EXPECT_EQ(0, truncated_index.GetCount());
+    EXPECT_FALSE(truncated_index.Lookup(1));
+    const Index truncated_small(truncated, storage, 1);
+    EXPECT_FALSE(truncated_small.IsValid());
+
+    // Cleared flash memory after the record
+    memset(buffer + tail.GetUsed(), 0xFF, 10);
+    const Decoder flash(buffer, tail.GetUsed() + 10);
+    const Index flash_index(flash, storage, 10);
+    EXPECT_TRUE(flash_index.IsValid());
+    EXPECT_EQ(2, flash_index.GetCount());
+
+    // Zero padding after the record, as in a cleared buffer
+    memset(buffer + tail.GetUsed(), 0, 10);
+    const Decoder zeros(buffer, tail.GetUsed() + 10);
+    const Index zeros_index(zeros, storage, 10);
+    EXPECT_TRUE(zeros_index.IsValid());
+    EXPECT_EQ(2, zeros_index.GetCount());
+    EXPECT_EQ(3, zeros_index.Get(2, a16_res));
+    const Index zeros_small(zeros, storage, 1);
+    EXPECT_TRUE(zeros_small.IsValid());
+
+    // The same check for the inner pointer
+    Decoder cursor(buffer, tail.GetUsed() + 10);
+    size_t cursor_count = 0;
+    while(cursor.FieldNext(id)) {
+        cursor_count++;
+    }
+    EXPECT_EQ(2, cursor_count);
+    EXPECT_TRUE(cursor.FieldEnd());
+    Decoder cursor_truncated(buffer, tail.GetUsed() - 1);
+    cursor_count = 0;
+    while(cursor_truncated.FieldNext(id)) {
+        cursor_count++;
+    }
+    EXPECT_EQ(2, cursor_count); // the key of the truncated field is read before its data
+    EXPECT_FALSE(cursor_truncated.FieldEnd());
+
+    // Read leaves the inner pointer at the field data
+    Encoder scalars(buffer, sizeof (buffer));
+    EXPECT_TRUE(scalars.Write(1, 5));
+    EXPECT_TRUE(scalars.Write(2, 6));
+    EXPECT_TRUE(scalars.Write(3, 7));
+    Decoder scalars_dec(buffer, scalars.GetUsed());
+    EXPECT_TRUE(scalars_dec.Read(1, value));
+    EXPECT_EQ(5, value);
+    EXPECT_TRUE(scalars_dec.FieldNext(id));
+    EXPECT_EQ(2, id);
+}
+
+/*
+ * Concurrent reads of the same index, each thread does the same lookups and counts wrong results
+ */
+static size_t lookup_threads(const Index & index, KeyType count, size_t threads, size_t lookups) {
+    std::atomic<size_t> errors(0);
+    auto reader = [&](size_t seed) {
+        uint64_t value;
+        for (size_t i = 0; i < lookups; i++) {
+            KeyType id = static_cast<KeyType> ((seed + i * 7919) % count + 1);
+            if(!index.Get(id, value) || value != id * 1000ULL) {
+                errors++;
+            }
+        }
+    };
+    std::vector<std::thread> list;
+    for (size_t t = 0; t < threads; t++) {
+        list.emplace_back(reader, t);
+    }
+    for (auto & thread : list) {
+        thread.join();
+    }
+    return errors;
+}
+
+static const KeyType lookup_count = 500;
+static uint8_t lookup_buffer[lookup_count * 10];
+static FieldRef lookup_storage[lookup_count];
+
+TEST(Microprop, LookupThreads) {
+
+    Encoder enc(lookup_buffer, sizeof (lookup_buffer));
+    for (KeyType id = 1; id <= lookup_count; id++) {
+        ASSERT_TRUE(enc.Write(id, static_cast<uint64_t> (id) * 1000));
+    }
+
+    const Decoder dec(lookup_buffer, enc.GetUsed());
+    const Index index(dec, lookup_storage, lookup_count);
+    ASSERT_TRUE(index.IsIndexed());
+
+    size_t threads = std::min(std::max(2U, std::thread::hardware_concurrency()), 8U);
+    EXPECT_EQ(0, lookup_threads(index, lookup_count, threads, 10000));
+}
+
+TEST(Microprop, DISABLED_LookupThreadsBenchmark) {
+
+    Encoder enc(lookup_buffer, sizeof (lookup_buffer));
+    for (KeyType id = 1; id <= lookup_count; id++) {
+        ASSERT_TRUE(enc.Write(id, static_cast<uint64_t> (id) * 1000));
+    }
+
+    const Decoder dec(lookup_buffer, enc.GetUsed());
+    const Index index(dec, lookup_storage, lookup_count);
+    ASSERT_TRUE(index.IsIndexed());
+
+    const size_t lookups = 400000;
+    size_t hardware = std::max(2U, std::thread::hardware_concurrency());
+    size_t max_threads = std::min(hardware, static_cast<size_t> (8));
+    double single = 0;
+    for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+        auto start = std::chrono::steady_clock::now();
+        EXPECT_EQ(0, lookup_threads(index, lookup_count, threads, lookups));
+        double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if(threads == 1) {
+            single = sec;
+        }
+        // Each thread does the same work, so the total throughput grows with the number of threads
+        std::cout << "Threads " << threads << ": " << static_cast<size_t> (threads * lookups / sec) << " lookups/s, scaling "
+                << threads * single / sec << std::endl;
+    }
+}
+
+TEST(Microprop, Arena) {
+
+    uint8_t buffer[1000];
+    Encoder enc(buffer, sizeof (buffer));
+
+    uint8_t a8[3] = {1, 2, 3};
+    int32_t a32[100];
+    for (int i = 0; i < 100; i++) {
+        a32[i] = i * 1000 - 50000;
+    }
+    double d[2] = {0.5, 1.1};
+    uint8_t blob[50];
+    memset(blob, 0xAA, sizeof (blob));
+
+    EXPECT_TRUE(enc.Write(1, a8));
+    EXPECT_TRUE(enc.Write(2, a32));
+    EXPECT_TRUE(enc.Write(3, d));
+    EXPECT_TRUE(enc.Write(4, blob, sizeof (blob)));
+    EXPECT_TRUE(enc.Write(5, 5));
+
+    Decoder dec(buffer, enc.GetUsed());
+
+    uint8_t memory[1000];
+    Arena arena(memory, sizeof (memory));
+
+    uint8_t *a8_res = nullptr;
+    EXPECT_EQ(3, dec.Read(1, a8_res, arena));
+    ASSERT_NE(nullptr, a8_res);
+    EXPECT_TRUE(memcmp(a8, a8_res, sizeof (a8)) == 0);
+    EXPECT_EQ(3, arena.GetUsed());
+
+    int64_t *a64_res = nullptr;
+    EXPECT_EQ(100, dec.Read(2, a64_res, arena));
+    ASSERT_NE(nullptr, a64_res);
+    EXPECT_EQ(0, reinterpret_cast<uintptr_t> (a64_res) % alignof (int64_t));
+    for (int i = 0; i < 100; i++) {
+        EXPECT_EQ(a32[i], a64_res[i]);
+    }
+
+    double *d_res = nullptr;
+    EXPECT_EQ(2, dec.Get(3, d_res, arena));
+    ASSERT_NE(nullptr, d_res);
+    EXPECT_EQ(0.5, d_res[0]);
+    EXPECT_EQ(1.1, d_res[1]);
+
+    uint8_t *blob_res = nullptr;
+    EXPECT_EQ(50, dec.Read(4, blob_res, arena));
+    ASSERT_NE(nullptr, blob_res);
+    EXPECT_TRUE(memcmp(blob, blob_res, sizeof (blob)) == 0);
+
+    int *wrong = nullptr;
+    EXPECT_EQ(0, dec.Read(4, wrong, arena)); // blob only as uint8_t
+    EXPECT_EQ(0, dec.Read(5, wrong, arena)); // not an array
+    EXPECT_EQ(0, dec.Read(6, wrong, arena)); // not found
+    EXPECT_EQ(nullptr, wrong);
+
+    // Not enough memory
+    size_t used = arena.GetUsed();
+    EXPECT_EQ(0, dec.Read(2, a64_res, arena));
+    EXPECT_EQ(used, arena.GetUsed());
+
+    arena.Reset();
+    EXPECT_EQ(0, arena.GetUsed());
+    FieldRef storage[10];
+    Index index(dec, storage, 10);
+    EXPECT_EQ(100, index.Get(2, a64_res, arena));
+    EXPECT_EQ(a32[99], a64_res[99]);
+}
+
+TEST(Microprop, Batch) {
+
+    const size_t count = 20;
+    uint8_t records[count][50];
+    Decoder decoders[count];
+    Decoder * list[count];
+    size_t records_size = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        Encoder enc(records[i], sizeof (records[i]));
+        int16_t a16[2] = {static_cast<int16_t> (i), static_cast<int16_t> (-i)};
+        if(i % 2) {
+            // Another field order
+            EXPECT_TRUE(enc.Write(2, 0.5 * i));
+            EXPECT_TRUE(enc.Write(1, i * 100));
+        } else {
+            EXPECT_TRUE(enc.Write(1, i * 100));
+            EXPECT_TRUE(enc.Write(2, 0.5 * i));
+        }
+        EXPECT_TRUE(enc.Write(300, a16));
+        EXPECT_TRUE(enc.WriteAsString(4, i % 3 ? "abc" : "de"));
+        decoders[i].AssignBuffer(records[i], enc.GetUsed());
+        list[i] = &decoders[i];
+        records_size += enc.GetUsed();
+    }
+
+    uint8_t buffer[1000];
+    Encoder batch_enc(buffer, sizeof (buffer));
+    ASSERT_TRUE(batch_enc.WriteBatch(list, count));
+    EXPECT_LT(batch_enc.GetUsed(), records_size);
+    EXPECT_EQ(412, batch_enc.GetUsed()); // 1 + 1:uint16[20] + 2:float64[20] + 300 and 4 with offset tables
+
+    BatchDecoder batch(buffer, batch_enc.GetUsed());
+    EXPECT_EQ(count, batch.GetCount());
+
+    size_t values[count];
+    EXPECT_EQ(0, batch.ReadColumn(1, values, count - 1)); // small buffer
+    ASSERT_EQ(count, batch.ReadColumn(1, values, count));
+    double d[count];
+    ASSERT_EQ(count, batch.ReadColumn(2, d, count));
+    for (size_t i = 0; i < count; i++) {
+        EXPECT_EQ(i * 100, values[i]);
+        EXPECT_EQ(0.5 * i, d[i]);
+    }
+    EXPECT_EQ(0, batch.ReadColumn(300, values, count)); // not a number column
+    EXPECT_EQ(0, batch.ReadColumn(5, values, count)); // not found
+
+    uint8_t result[50];
+    for (size_t i = 0; i < count; i++) {
+        Encoder enc(result, sizeof (result));
+        ASSERT_TRUE(enc.WriteRecord(batch, i));
+
+        Decoder dec(result, enc.GetUsed());
+        int value;
+        EXPECT_TRUE(dec.Read(1, value));
+        EXPECT_EQ(i * 100, value);
+        double dvalue;
+        EXPECT_TRUE(dec.Read(2, dvalue));
+        EXPECT_EQ(0.5 * i, dvalue);
+        int16_t a16[2];
+        EXPECT_EQ(2, dec.Read(300, a16));
+        EXPECT_EQ(static_cast<int16_t> (i), a16[0]);
+        EXPECT_EQ(static_cast<int16_t> (-i), a16[1]);
+        EXPECT_STREQ(i % 3 ? "abc" : "de", dec.ReadAsString(4));
+        if(i % 2 == 0) {
+            // Same field order as the first record
+            ASSERT_EQ(decoders[i].GetSize(), enc.GetUsed());
+            EXPECT_TRUE(memcmp(records[i], result, enc.GetUsed()) == 0);
+        }
+    }
+    Encoder enc(result, sizeof (result));
+    EXPECT_FALSE(enc.WriteRecord(batch, count));
+    EXPECT_EQ(0, enc.GetUsed());
+
+    // Different set of keys
+    Encoder other(records[5], sizeof (records[5]));
+    EXPECT_TRUE(other.Write(1, 1));
+    decoders[5].AssignBuffer(records[5], other.GetUsed());
+    Encoder fail(buffer, sizeof (buffer));
+    EXPECT_FALSE(fail.WriteBatch(list, count));
+    EXPECT_EQ(0, fail.GetUsed());
+
+    // Truncated key at the end of the records is a decode error
+    for (size_t i = 0; i < count; i++) {
+        Encoder record_enc(records[i], sizeof (records[i]));
+        EXPECT_TRUE(record_enc.Write(1, i));
+        EXPECT_TRUE(record_enc.Write(1000, i));
+        decoders[i].AssignBuffer(records[i], record_enc.GetUsed() - 2);
+    }
+    EXPECT_FALSE(fail.WriteBatch(list, count));
+    EXPECT_EQ(0, fail.GetUsed());
+
+    // Packed kinds and records ending with an array
+    for (size_t i = 0; i < count; i++) {
+        Encoder record_enc(records[i], sizeof (records[i]));
+        int16_t a16[2] = {static_cast<int16_t> (i), 1000};
+        EXPECT_TRUE(record_enc.Write(1, 1000 - static_cast<int> (i) * 100));
+        EXPECT_TRUE(record_enc.Write(2, i % 2 == 0));
+        EXPECT_TRUE(record_enc.Write(3, 0.25f * static_cast<float> (i)));
+        EXPECT_TRUE(record_enc.Write(4, a16));
+        decoders[i].AssignBuffer(records[i], record_enc.GetUsed());
+    }
+    Encoder packed_enc(buffer, sizeof (buffer));
+    ASSERT_TRUE(packed_enc.WriteBatch(list, count));
+    BatchDecoder packed(buffer, packed_enc.GetUsed());
+    ASSERT_EQ(count, packed.GetCount());
+
+    int ints[count];
+    bool flags[count];
+    float floats[count];
+    ASSERT_EQ(count, packed.ReadColumn(1, ints, count));
+    ASSERT_EQ(count, packed.ReadColumn(2, flags, count));
+    ASSERT_EQ(count, packed.ReadColumn(3, floats, count));
+    for (size_t i = 0; i < count; i++) {
+        EXPECT_EQ(1000 - static_cast<int> (i) * 100, ints[i]);
+        EXPECT_EQ(i % 2 == 0, flags[i]);
+        EXPECT_EQ(0.25f * static_cast<float> (i), floats[i]);
+    }
+    int8_t narrow[count];
+    EXPECT_EQ(0, packed.ReadColumn(1, narrow, count)); // overflow
+
+    // Random access in constant time
+    FieldRef column = packed.Lookup(1);
+    int value;
+    EXPECT_TRUE(packed.GetValue(column, 15, value));
+    EXPECT_EQ(-500, value);
+    EXPECT_FALSE(packed.GetValue(column, count, value));
+    uint8_t value_buffer[BatchDecoder::ValueSize];
+    const uint8_t *data;
+    size_t size;
+    EXPECT_TRUE(packed.ColumnValue(column, 15, data, size, value_buffer));
+    EXPECT_EQ(3, size); // int16
+    EXPECT_FALSE(packed.ColumnValue(column, 15, data, size, nullptr));
+    EXPECT_TRUE(packed.ColumnValue(packed.Lookup(4), 19, data, size, nullptr));
+    EXPECT_EQ(5, size); // [19, 1000]
+
+    for (size_t i = 0; i < count; i++) {
+        Encoder record_enc(result, sizeof (result));
+        ASSERT_TRUE(record_enc.WriteRecord(packed, i));
+        ASSERT_EQ(decoders[i].GetSize(), record_enc.GetUsed());
+        EXPECT_TRUE(memcmp(records[i], result, record_enc.GetUsed()) == 0);
+    }
+
+    // Truncated key after the last column
+    ASSERT_LT(packed_enc.GetUsed() + 2, sizeof (buffer));
+    buffer[packed_enc.GetUsed()] = 0xCD;
+    buffer[packed_enc.GetUsed() + 1] = 0x03;
+    BatchDecoder truncated(buffer, packed_enc.GetUsed() + 2);
+    Encoder truncated_enc(result, sizeof (result));
+    EXPECT_FALSE(truncated_enc.WriteRecord(truncated, 0));
+    EXPECT_EQ(0, truncated_enc.GetUsed());
+
+    // Wrong width in the column tag after the blob header
+    buffer[static_cast<size_t> (packed.GetBuffer() - buffer) + column.offset + 2] = BatchDecoder::ColumnUnsigned << 4 | 3;
+    EXPECT_FALSE(packed.GetValue(column, 0, value));
+    Encoder corrupted(result, sizeof (result));
+    EXPECT_FALSE(corrupted.WriteRecord(packed, count - 1));
+    EXPECT_EQ(0, corrupted.GetUsed());
+}
+
+TEST(Microprop, BufferPool) {
+
+    alignas(BufferPool::CacheLine) static uint8_t memory[1000];
+    BufferPool pool(memory + 1, sizeof (memory) - 1, 100);
+    EXPECT_EQ(128, pool.GetBufferSize());
+    EXPECT_EQ(7, pool.GetCount()); // 999 - 63 bytes for alignment
+
+    std::vector<BufferPool::Handle> list;
+    for (size_t i = 0; i < pool.GetCount(); i++) {
+        BufferPool::Handle handle = pool.Acquire();
+        ASSERT_TRUE(handle);
+        EXPECT_EQ(0, reinterpret_cast<uintptr_t> (handle.GetBuffer()) % BufferPool::CacheLine);
+        EXPECT_EQ(128, handle.GetFree());
+        EXPECT_TRUE(handle.Write(1, i));
+        list.push_back(std::move(handle));
+        EXPECT_FALSE(handle);
+    }
+    EXPECT_FALSE(pool.Acquire()); // all buffers are in use
+
+    // Moved encoders keep the data and continue writing
+    for (size_t i = 0; i < list.size(); i++) {
+        EXPECT_TRUE(list[i].Write(2, 0.5));
+        Decoder dec(list[i].GetBuffer(), list[i].GetUsed());
+        size_t value;
+        EXPECT_TRUE(dec.Read(1, value));
+        EXPECT_EQ(i, value);
+    }
+
+    list.pop_back();
+    BufferPool::Handle handle = pool.Acquire();
+    EXPECT_TRUE(handle);
+    EXPECT_EQ(0, handle.GetUsed());
+    handle.Release();
+    EXPECT_FALSE(handle);
+    list.clear();
+
+    // Buffers released by another thread
+    const size_t count = 10000;
+    std::atomic<size_t> errors(0);
+    std::vector<BufferPool::Handle> queue;
+    std::mutex mutex;
+    std::atomic<bool> done(false);
+
+    std::thread consumer([&]() {
+        std::vector<BufferPool::Handle> items;
+        while(true) {
+            bool finished = done;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                items.swap(queue);
+            }
+            for (auto & item : items) {
+                Decoder dec(item.GetBuffer(), item.GetUsed());
+                size_t value;
+                if(!dec.Read(1, value)) {
+                    errors++;
+                }
+            }
+            if(finished && items.empty()) {
+                break;
+            }
+            items.clear(); // release the buffers
+            std::this_thread::yield();
+        }
+    });
+
+    for (size_t i = 0; i < count; i++) {
+        BufferPool::Handle item = pool.Acquire();
+        while(!item) {
+            std::this_thread::yield();
+            item = pool.Acquire();
+        }
+        if(!item.Write(1, i)) {
+            errors++;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        queue.push_back(std::move(item));
+    }
+    done = true;
+    consumer.join();
+    queue.clear();
+    EXPECT_EQ(0, errors);
+
+    size_t free = 0;
+    std::vector<BufferPool::Handle> all;
+    for (BufferPool::Handle item = pool.Acquire(); item; item = pool.Acquire()) {
+        all.push_back(std::move(item));
+        free++;
+    }
+    EXPECT_EQ(pool.GetCount(), free);
+}
+
+TEST(Microprop, DISABLED_BufferPoolBenchmark) {
+
+    const size_t count = 1000000;
+    const size_t size = 256;
+    alignas(BufferPool::CacheLine) static uint8_t memory[size * 16];
+    BufferPool pool(memory, sizeof (memory), size);
+    size_t used = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < count; i++) {
+        uint8_t *data = static_cast<uint8_t *> (malloc(size));
+        Encoder enc(data, size);
+        enc.Write(1, i);
+        enc.Write(2, 0.5);
+        enc.WriteAsString(3, "value");
+        used += enc.GetUsed();
+        free(data);
+    }
+    double heap = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < count; i++) {
+        BufferPool::Handle enc = pool.Acquire();
+        enc.Write(1, i);
+        enc.Write(2, 0.5);
+        enc.WriteAsString(3, "value");
+        used -= enc.GetUsed();
+    }
+    double pooled = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    EXPECT_EQ(0, used);
+    std::cout << "malloc: " << static_cast<size_t> (count / heap) << " records/s, pool: "
+            << static_cast<size_t> (count / pooled) << " records/s" << std::endl;
+}
+
+TEST(Microprop, Group) {
+
+    uint8_t buffer[200];
+    Encoder enc(buffer, sizeof (buffer));
+
+    uint16_t a16[3] = {10, 20, 30};
+
+    EXPECT_FALSE(enc.EndGroup());
+    EXPECT_TRUE(enc.Write(1, 100));
+    EXPECT_TRUE(enc.BeginGroup(2));
+    EXPECT_EQ(1, enc.GetGroupDepth());
+    EXPECT_TRUE(enc.Write(1, 200));
+    EXPECT_TRUE(enc.Write(3, a16));
+    EXPECT_TRUE(enc.BeginGroup(4));
+    EXPECT_TRUE(enc.WriteAsString(1, "inner"));
+    EXPECT_TRUE(enc.EndGroup());
+    EXPECT_TRUE(enc.EndGroup());
+    EXPECT_EQ(0, enc.GetGroupDepth());
+    EXPECT_TRUE(enc.BeginGroup(5)); // empty group
+    EXPECT_TRUE(enc.EndGroup());
+    EXPECT_TRUE(enc.Write(6, 600));
+    EXPECT_EQ(40, enc.GetUsed());
+
+    Decoder dec(buffer, enc.GetUsed());
+
+    // Groups are skipped as one field
+    KeyType id;
+    KeyType order[] = {1, 2, 5, 6};
+    for (size_t i = 0; i < sizeof (order) / sizeof (order[0]); i++) {
+        EXPECT_TRUE(dec.FieldNext(id));
+        EXPECT_EQ(order[i], id);
+    }
+    EXPECT_FALSE(dec.FieldNext(id));
+
+    int value;
+    EXPECT_TRUE(dec.Read(1, value));
+    EXPECT_EQ(100, value);
+    EXPECT_TRUE(dec.Read(6, value));
+    EXPECT_EQ(600, value);
+
+    Decoder group = dec.OpenGroup(2);
+    EXPECT_EQ(&buffer[8], group.GetBuffer()); // no copy
+    EXPECT_EQ(22, group.GetSize());
+    EXPECT_TRUE(group.Read(1, value));
+    EXPECT_EQ(200, value);
+    uint16_t a16_res[3];
+    EXPECT_EQ(3, group.Read(3, a16_res));
+    EXPECT_TRUE(memcmp(a16, a16_res, sizeof (a16)) == 0);
+    EXPECT_FALSE(group.Read(6, value));
+
+    Decoder inner = group.OpenGroup(4);
+    EXPECT_STREQ("inner", inner.ReadAsString(1));
+
+    EXPECT_EQ(0, dec.OpenGroup(5).GetSize());
+    EXPECT_EQ(nullptr, dec.OpenGroup(6).GetBuffer()); // not a group
+    EXPECT_EQ(nullptr, dec.OpenGroup(7).GetBuffer()); // not found
+
+    // Nesting limit, the buffer is not changed
+    Encoder deep(buffer, sizeof (buffer));
+    for (size_t i = 0; i < MICROPROP_GROUP_DEPTH; i++) {
+        EXPECT_TRUE(deep.BeginGroup(1));
+    }
+    size_t used = deep.GetUsed();
+    EXPECT_FALSE(deep.BeginGroup(1));
+    EXPECT_EQ(used, deep.GetUsed());
+}
+
+static bool json_sink(void *context, const char *data, size_t size) {
+    static_cast<std::string *> (context)->append(data, size);
+    return true;
+}
+
+TEST(Microprop, Json) {
+
+    uint8_t buffer[200];
+    Encoder enc(buffer, sizeof (buffer));
+
+    uint8_t blob[4] = {0xFF, 0, 1, 2};
+    int16_t arr[3] = {1, -2, 300};
+    EXPECT_TRUE(enc.Write(1, 42));
+    EXPECT_TRUE(enc.Write(2, -7));
+    EXPECT_TRUE(enc.Write(3, 1.5f));
+    EXPECT_TRUE(enc.Write(4, 0.1));
+    EXPECT_TRUE(enc.Write(5, true));
+    EXPECT_TRUE(enc.WriteAsString(6, "a\"b\\c\n\x01"));
+    EXPECT_TRUE(enc.Write(7, blob, sizeof (blob)));
+    EXPECT_TRUE(enc.Write(8, arr));
+    EXPECT_TRUE(enc.Write(9, std::numeric_limits<double>::infinity()));
+    EXPECT_TRUE(enc.Write(10, static_cast<uint64_t> (-1)));
+    EXPECT_TRUE(enc.Write(11, std::numeric_limits<int64_t>::min()));
+
+    Decoder dec(buffer, enc.GetUsed());
+    const char *expected = "{\"1\":42,\"2\":-7,\"3\":1.5,\"4\":0.1,\"5\":true,\"6\":\"a\\\"b\\\\c\\n\\u0001\","
+            "\"7\":{\"base64\":\"/wABAg==\"},\"8\":[1,-2,300],\"9\":null,"
+            "\"10\":18446744073709551615,\"11\":-9223372036854775808}";
+
+    char text[300];
+    JsonWriter writer(text, sizeof (text));
+    ASSERT_TRUE(writer.Write(dec));
+    EXPECT_EQ(expected, std::string(text, writer.GetUsed()));
+
+    // Small buffer without the sink, the output is not changed
+    JsonWriter small(text, 20);
+    EXPECT_FALSE(small.Write(dec));
+    EXPECT_EQ(0, small.GetUsed());
+    EXPECT_FALSE(small.Flush());
+
+    // Small buffer with the sink
+    std::string stream;
+    char chunk[7];
+    JsonWriter chunked(chunk, sizeof (chunk), json_sink, &stream);
+    ASSERT_TRUE(chunked.Write(dec));
+    ASSERT_TRUE(chunked.Flush());
+    EXPECT_EQ(expected, stream);
+
+    // And back, NaN and infinity are lost
+    uint8_t restored[200];
+    Encoder json_enc(restored, sizeof (restored));
+    json_enc.SetCompactFloat(true); // 1.5 is written as float32 again
+    size_t parsed = 0;
+    std::string json(expected);
+    json += " {\"1\":2}";
+    ASSERT_TRUE(json_enc.WriteJson(json.c_str(), json.size(), &parsed));
+    EXPECT_EQ(strlen(expected), parsed);
+    EXPECT_EQ(enc.GetUsed() - 10, json_enc.GetUsed()); // without field 9 (1 + 9 bytes)
+
+    Decoder json_dec(restored, json_enc.GetUsed());
+    int64_t value;
+    EXPECT_TRUE(json_dec.Read(2, value));
+    EXPECT_EQ(-7, value);
+    float f;
+    EXPECT_TRUE(json_dec.Read(3, f));
+    EXPECT_EQ(1.5f, f);
+    EXPECT_STREQ("a\"b\\c\n\x01", json_dec.ReadAsString(6));
+    EXPECT_FALSE(json_dec.FieldFind(9));
+
+    JsonWriter writer2(text, sizeof (text));
+    ASSERT_TRUE(writer2.Write(json_dec));
+    EXPECT_EQ(std::string(expected).replace(strstr(expected, ",\"9\":null") - expected, 9, ""),
+            std::string(text, writer2.GetUsed()));
+
+    // Unicode escapes are written as UTF-8
+    Encoder utf(restored, sizeof (restored));
+    const char *unicode = "{ \"1\" : \"\\u00e9\\ud83d\\ude00\", \"2\": null, \"3\": [] }";
+    ASSERT_TRUE(utf.WriteJson(unicode, strlen(unicode)));
+    Decoder utf_dec(restored, utf.GetUsed());
+    EXPECT_STREQ("\xC3\xA9\xF0\x9F\x98\x80", utf_dec.ReadAsString(1));
+    EXPECT_FALSE(utf_dec.FieldFind(2));
+
+    // Errors, the buffer is not changed
+    const char *wrong[] = {"", "{", "{\"a\":1}", "{\"0\":1}", "{\"1\":}", "{\"1\":1,}", "{\"1\":[1,]}",
+        "{\"1\":\"abc}", "{\"1\":[\"a\"]}", "{\"1\":{\"base64\":\"A\"}}", "{\"1\":1e400}", "{\"99999999999\":1}",
+        "{\"1\":01}", "{\"1\":1.}", "{\"1\":.5}", "{\"1\":+1}", "{\"1\":1e}", "{\"1\":[nul]}"};
+    for (size_t i = 0; i < sizeof (wrong) / sizeof (wrong[0]); i++) {
+        Encoder err(restored, sizeof (restored));
+        EXPECT_TRUE(err.Write(1, 1));
+        size_t used = err.GetUsed();
+        EXPECT_FALSE(err.WriteJson(wrong[i], strlen(wrong[i]), &parsed)) << wrong[i];
+        EXPECT_EQ(used, err.GetUsed()) << wrong[i];
+        EXPECT_EQ(0, parsed);
+    }
+
+    // Formatting of floating point numbers
+    const double numbers[] = {42.0, -0.0, 1e20, -1.5e-7, 0.001, 123.456, 5e-324, 1.7976931348623157e308,
+        0.30000000000000004, 2.2250738585072014e-308};
+    const char *formatted[] = {"42.0", "-0.0", "1e20", "-1.5e-7", "0.001", "123.456", "5e-324", "1.7976931348623157e308",
+        "0.30000000000000004", "2.2250738585072014e-308"};
+    for (size_t i = 0; i < sizeof (numbers) / sizeof (numbers[0]); i++) {
+        Encoder number(restored, sizeof (restored));
+        EXPECT_TRUE(number.Write(1, numbers[i]));
+        Decoder number_dec(restored, number.GetUsed());
+        JsonWriter number_writer(text, sizeof (text));
+        ASSERT_TRUE(number_writer.Write(number_dec));
+        EXPECT_EQ(std::string("{\"1\":") + formatted[i] + "}", std::string(text, number_writer.GetUsed()));
+
+        // Integer values stay floating point
+        Encoder number_back(restored, sizeof (restored));
+        ASSERT_TRUE(number_back.WriteJson(text, number_writer.GetUsed()));
+        EXPECT_EQ(number.GetUsed(), number_back.GetUsed());
+        double number_value;
+        EXPECT_TRUE(Decoder(restored, number_back.GetUsed()).Read(1, number_value));
+        EXPECT_TRUE(memcmp(&numbers[i], &number_value, sizeof (double)) == 0) << formatted[i];
+    }
+
+    // NaN in an array is written as null and read back
+    double nan_array[2] = {0.5, std::numeric_limits<double>::quiet_NaN()};
+    Encoder nan_enc(restored, sizeof (restored));
+    EXPECT_TRUE(nan_enc.Write(1, nan_array));
+    JsonWriter nan_writer(text, sizeof (text));
+    ASSERT_TRUE(nan_writer.Write(Decoder(restored, nan_enc.GetUsed())));
+    EXPECT_EQ("{\"1\":[0.5,null]}", std::string(text, nan_writer.GetUsed()));
+    Encoder nan_back(restored, sizeof (restored));
+    ASSERT_TRUE(nan_back.WriteJson(text, nan_writer.GetUsed()));
+    Decoder nan_dec(restored, nan_back.GetUsed());
+    double nan_res[2];
+    EXPECT_EQ(2, nan_dec.Read(1, nan_res));
+    EXPECT_EQ(0.5, nan_res[0]);
+    EXPECT_TRUE(std::isnan(nan_res[1]));
+
+    // The last field is an array, a truncated record is an error
+    int16_t tail[3] = {1, 2, 3};
+    Encoder tail_enc(restored, sizeof (restored));
+    EXPECT_TRUE(tail_enc.Write(1, 10));
+    EXPECT_TRUE(tail_enc.Write(2, tail));
+    JsonWriter tail_writer(text, sizeof (text));
+    ASSERT_TRUE(tail_writer.Write(Decoder(restored, tail_enc.GetUsed())));
+    EXPECT_EQ("{\"1\":10,\"2\":[1,2,3]}", std::string(text, tail_writer.GetUsed()));
+    tail_writer.Reset();
+    EXPECT_FALSE(tail_writer.Write(Decoder(restored, tail_enc.GetUsed() - 1)));
+    EXPECT_EQ(0, tail_writer.GetUsed());
+
+    // Zero padding after the record is the end of the record
+    memset(restored + tail_enc.GetUsed(), 0, 10);
+    JsonWriter zeros_writer(text, sizeof (text));
+    ASSERT_TRUE(zeros_writer.Write(Decoder(restored, tail_enc.GetUsed() + 10)));
+    EXPECT_EQ("{\"1\":10,\"2\":[1,2,3]}", std::string(text, zeros_writer.GetUsed()));
+
+    // Numbers of any length are rounded correctly, 2^53 + 1 is in the middle between two doubles
+    std::string long_number = "{\"1\":9007199254740993." + std::string(120, '0');
+    const std::string long_json[] = {long_number + "}", long_number + "1}", "{\"1\":0." + std::string(400, '0') + "1e400}"};
+    const double long_value[] = {9007199254740992.0, 9007199254740994.0, 0.1};
+    for (size_t i = 0; i < sizeof (long_json) / sizeof (long_json[0]); i++) {
+        Encoder long_enc(restored, sizeof (restored));
+        ASSERT_TRUE(long_enc.WriteJson(long_json[i].c_str(), long_json[i].size())) << i;
+        double long_res;
+        EXPECT_TRUE(Decoder(restored, long_enc.GetUsed()).Read(1, long_res));
+        EXPECT_EQ(long_value[i], long_res);
+    }
+
+    // Numbers do not depend on the locale, if the locale with decimal comma is installed
+    if(setlocale(LC_NUMERIC, "de_DE.UTF-8")) {
+        Encoder locale_enc(restored, sizeof (restored));
+        const char *locale_json = "{\"1\":0.5,\"2\":1.2345678901234567890123e-5}";
+        EXPECT_TRUE(locale_enc.WriteJson(locale_json, strlen(locale_json)));
+        JsonWriter locale_writer(text, sizeof (text));
+        EXPECT_TRUE(locale_writer.Write(Decoder(restored, locale_enc.GetUsed())));
+        EXPECT_EQ("{\"1\":0.5,\"2\":1.2345678901234568e-5}", std::string(text, locale_writer.GetUsed()));
+        setlocale(LC_NUMERIC, "C");
+    }
+}
+
+TEST(Microprop, DISABLED_JsonBenchmark) {
+
+    // Throughput with a record of floating point numbers
+    uint8_t restored[200];
+    Encoder doubles(restored, sizeof (restored));
+    for (KeyType id = 1; id <= 20; id++) {
+        EXPECT_TRUE(doubles.Write(id, 1000.0 / id + 0.001 * id));
+    }
+    const Decoder doubles_dec(restored, doubles.GetUsed());
+    uint8_t back_buffer[sizeof (restored)];
+    char json_text[1000];
+    const size_t count = 20000;
+    size_t total = 0;
+    std::chrono::steady_clock::duration export_time(0);
+    std::chrono::steady_clock::duration import_time(0);
+    for (size_t i = 0; i < count; i++) {
+        auto start = std::chrono::steady_clock::now();
+        JsonWriter loop(json_text, sizeof (json_text));
+        if(!loop.Write(doubles_dec)) {
+            FAIL();
+        }
+        auto middle = std::chrono::steady_clock::now();
+        Encoder back(back_buffer, sizeof (back_buffer));
+        if(!back.WriteJson(json_text, loop.GetUsed())) {
+            FAIL();
+        }
+        import_time += std::chrono::steady_clock::now() - middle;
+        export_time += middle - start;
+        total += loop.GetUsed();
+    }
+    EXPECT_TRUE(memcmp(restored, back_buffer, doubles.GetUsed()) == 0);
+    std::cout << "JSON export: " << static_cast<size_t> (total / std::chrono::duration<double>(export_time).count() / 1000000)
+            << " MB/s, import: " << static_cast<size_t> (total / std::chrono::duration<double>(import_time).count() / 1000000) << " MB/s\n";
+}
+
 // Full enumeration of all possible of keys and types values
 
 TEST(Microprop, DISABLED_StressTest) {
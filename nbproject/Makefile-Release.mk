@@ -40,6 +40,7 @@ OBJECTFILES= \
 	${OBJECTDIR}/_ext/b8a8e5b6/version.o \
 	${OBJECTDIR}/_ext/b8a8e5b6/zone.o \
 	${OBJECTDIR}/microprop.o \
+	${OBJECTDIR}/microprop_bake_test.o \
 	${OBJECTDIR}/microprop_test.o
 
 
@@ -92,6 +93,11 @@ ${OBJECTDIR}/microprop.o: microprop.cpp
 	${RM} "$@.d"
 	$(COMPILE.cc) -O2 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/microprop.o microprop.cpp
 
+${OBJECTDIR}/microprop_bake_test.o: microprop_bake_test.cpp
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.cc) -O2 -std=c++14 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/microprop_bake_test.o microprop_bake_test.cpp
+
 ${OBJECTDIR}/microprop_test.o: microprop_test.cpp
 	${MKDIR} -p ${OBJECTDIR}
 	${RM} "$@.d"